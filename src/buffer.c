@@ -1 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
 
+#include "buffer.h"
+
+int stream_buffer_init(struct stream_buffer *sbuf, uint8_t *base,
+		uint32_t no_bufs, uint32_t buf_size) {
+	uint32_t i;
+
+	sbuf->bufs = calloc(no_bufs, sizeof (uint8_t *));
+	if (!sbuf->bufs) {
+		fprintf(stderr, "Couldn't allocate buffer ring of %u\n", no_bufs);
+		return 1;
+	}
+
+	for (i = 0; i < no_bufs; ++i) {
+		sbuf->bufs[i] = base + (uint64_t) i * buf_size;
+	}
+
+	sbuf->base = base;
+	sbuf->index = 0;
+	sbuf->tail = 0;
+	sbuf->used = 0;
+	sbuf->size = no_bufs;
+	sbuf->buf_size = buf_size;
+
+	return 0;
+}
+
+void stream_buffer_free(struct stream_buffer *sbuf) {
+	free(sbuf->bufs);
+	sbuf->bufs = NULL;
+	sbuf->size = 0;
+	sbuf->used = 0;
+}
+
+int stream_buffer_acquire(struct stream_buffer *sbuf) {
+	int index;
+
+	if (sbuf->used == sbuf->size) {
+		return -1;
+	}
+
+	index = sbuf->index;
+	if (++sbuf->index == sbuf->size) {
+		sbuf->index = 0;
+	}
+	sbuf->used++;
+
+	return index;
+}
+
+void stream_buffer_cancel(struct stream_buffer *sbuf) {
+	sbuf->index = sbuf->index == 0 ? sbuf->size - 1 : sbuf->index - 1;
+	sbuf->used--;
+}
+
+void stream_buffer_release(struct stream_buffer *sbuf, uint32_t index) {
+	uint32_t count;
+
+	// no of buffers from the tail up to and including index
+	if (index >= sbuf->tail) {
+		count = index - sbuf->tail + 1;
+	} else {
+		count = sbuf->size - sbuf->tail + index + 1;
+	}
+
+	if (count > sbuf->used) {
+		fprintf(stderr, "Release of buffer %u not in use\n", index);
+		return;
+	}
+
+	sbuf->used -= count;
+	sbuf->tail = index + 1 == sbuf->size ? 0 : index + 1;
+}
@@ -1,6 +1,61 @@
 #ifndef IBV_BUFFER_H
 #define IBV_BUFFER_H
 
+#include <stdint.h>
 
+/**
+ * A ring of fixed size buffers carved from a single registered memory region.
+ * Buffers are handed out and given back in order, which matches the order
+ * work requests complete on a RC queue pair.
+ */
+struct stream_buffer {
+	// start of the memory holding all the buffers
+	uint8_t *base;
+	// set of buffers to hold the messages
+	uint8_t **bufs;
+	// current index of the buffer, next one to hand out
+	uint32_t index;
+	// oldest buffer still in use
+	uint32_t tail;
+	// no of buffers currently in use
+	uint32_t used;
+	// no of buffers allocated
+	uint32_t size;
+	// size of a single buffer
+	uint32_t buf_size;
+};
+
+/**
+ * Carve no_bufs buffers of buf_size bytes out of the memory at base.
+ */
+int stream_buffer_init(struct stream_buffer *sbuf, uint8_t *base,
+		uint32_t no_bufs, uint32_t buf_size);
+
+/**
+ * Release the book keeping of the ring, the memory itself belongs to the caller
+ */
+void stream_buffer_free(struct stream_buffer *sbuf);
+
+/**
+ * Get the next free buffer index, -1 if all the buffers are in use
+ */
+int stream_buffer_acquire(struct stream_buffer *sbuf);
+
+/**
+ * Give back the buffer handed out by the last acquire
+ */
+void stream_buffer_cancel(struct stream_buffer *sbuf);
+
+/**
+ * Give back all the buffers from the oldest one in use up to and including index
+ */
+void stream_buffer_release(struct stream_buffer *sbuf, uint32_t index);
+
+/**
+ * Number of buffers available for acquire
+ */
+static inline uint32_t stream_buffer_free_count(struct stream_buffer *sbuf) {
+	return sbuf->size - sbuf->used;
+}
 
 #endif /* IBV_BUFFER_H */
@@ -11,192 +11,177 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/param.h>
-
-#include "stream.h"
-
-static struct stream_dest *stream_client_exch_dest(const char *servername, int port,
-						 const struct stream_dest *my_dest) {
-	struct addrinfo *res, *t;
-	struct addrinfo hints = {
-		.ai_family   = AF_INET,
-		.ai_socktype = SOCK_STREAM
-	};
-	char *service;
-	char msg[sizeof "0000:000000:000000:00000000000000000000000000000000"];
-	int n;
-	int sockfd = -1;
-	struct stream_dest *rem_dest = NULL;
-	char gid[33];
-
-	if (asprintf(&service, "%d", port) < 0)
-		return NULL;
-
-	n = getaddrinfo(servername, service, &hints, &res);
-
-	if (n < 0) {
-		fprintf(stderr, "%s for %s:%d\n", gai_strerror(n), servername, port);
-		free(service);
-		return NULL;
-	}
-
-	for (t = res; t; t = t->ai_next) {
-		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
-		if (sockfd >= 0) {
-			if (!connect(sockfd, t->ai_addr, t->ai_addrlen))
-				break;
-			close(sockfd);
-			sockfd = -1;
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "lanes.h"
+#include "stream_verbs.h"
+
+/**
+ * A thread queuing its share of the messages on the connection, while the
+ * main thread posts them
+ */
+struct stream_client_producer {
+	struct stream_connect_ctx *ctx;
+	pthread_t thread;
+	uint8_t *buf;
+	uint64_t len;
+	int count;
+	int failed;
+};
+
+static void *stream_client_produce(void *arg) {
+	struct stream_client_producer *producer = arg;
+	int i, err;
+
+	for (i = 0; i < producer->count; ++i) {
+		while ((err = stream_submit(producer->ctx, producer->buf, producer->len)) == EAGAIN) {
+			sched_yield();
+		}
+		if (err) {
+			producer->failed = 1;
+			break;
 		}
 	}
 
-	freeaddrinfo(res);
-	free(service);
-
-	if (sockfd < 0) {
-		fprintf(stderr, "Couldn't connect to %s:%d\n", servername, port);
-		return NULL;
-	}
-
-	gid_to_wire_gid(&my_dest->gid, gid);
-	sprintf(msg, "%04x:%06x:%06x:%s", my_dest->lid, my_dest->qpn, my_dest->psn, gid);
-	if (write(sockfd, msg, sizeof msg) != sizeof msg) {
-		fprintf(stderr, "Couldn't send local address\n");
-		goto out;
-	}
-
-	if (read(sockfd, msg, sizeof msg) != sizeof msg) {
-		perror("client read");
-		fprintf(stderr, "Couldn't read remote address\n");
-		goto out;
-	}
-
-	write(sockfd, "done", sizeof "done");
-
-	rem_dest = malloc(sizeof *rem_dest);
-	if (!rem_dest)
-		goto out;
-
-	sscanf(msg, "%x:%x:%x:%s", &rem_dest->lid, &rem_dest->qpn, &rem_dest->psn, gid);
-	wire_gid_to_gid(gid, &rem_dest->gid);
-
-out:
-	close(sockfd);
-	return rem_dest;
+	return NULL;
 }
 
-static struct stream_dest *stream_server_exch_dest(struct stream_connect_ctx *ctx,
-						 int ib_port, enum ibv_mtu mtu,
-						 int port, int sl,
-						 const struct stream_dest *my_dest,
-						 int sgid_idx) {
-	struct addrinfo *res, *t;
-	struct addrinfo hints = {
-		.ai_flags    = AI_PASSIVE,
-		.ai_family   = AF_INET,
-		.ai_socktype = SOCK_STREAM
-	};
-	char *service;
-	char msg[sizeof "0000:000000:000000:00000000000000000000000000000000"];
-	int n;
-	int sockfd = -1, connfd;
-	struct stream_dest *rem_dest = NULL;
-	char gid[33];
-
-	if (asprintf(&service, "%d", port) < 0)
-		return NULL;
-
-	n = getaddrinfo(NULL, service, &hints, &res);
-
-	if (n < 0) {
-		fprintf(stderr, "%s for port %d\n", gai_strerror(n), port);
-		free(service);
-		return NULL;
-	}
-
-	for (t = res; t; t = t->ai_next) {
-		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
-		if (sockfd >= 0) {
-			n = 1;
-
-			setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof n);
-
-			if (!bind(sockfd, t->ai_addr, t->ai_addrlen))
+/**
+ * Send count messages on the connection, then close it and wait for the
+ * sends to drain. Returns 1 on failure.
+ */
+static int stream_client_send(struct stream_connect_ctx *ctx, uint8_t *buf, uint64_t len,
+		int count) {
+	int sent = 0, ne, err;
+
+	while (sent < count) {
+		while (sent < count) {
+			err = stream_send_msg(ctx, buf, len);
+			if (err == EAGAIN) {
 				break;
-			close(sockfd);
-			sockfd = -1;
+			} else if (err) {
+				fprintf(stderr, "Couldn't post send\n");
+				return 1;
+			}
+			++sent;
 		}
-	}
 
-	freeaddrinfo(res);
-	free(service);
+		ne = stream_progress(ctx);
+		if (ne < 0) {
+			return 1;
+		}
 
-	if (sockfd < 0) {
-		fprintf(stderr, "Couldn't listen to port %d\n", port);
-		return NULL;
+		if (stream_idle(ctx, ne)) {
+			return 1;
+		}
 	}
 
-	listen(sockfd, 1);
-	connfd = accept(sockfd, NULL, 0);
-	close(sockfd);
-	if (connfd < 0) {
-		fprintf(stderr, "accept() failed\n");
-		return NULL;
+	// the close is signaled, once the send buffers drain the server has
+	// every message
+	while ((err = stream_disconnect(ctx)) == EAGAIN) {
+		if (stream_progress(ctx) < 0) {
+			return 1;
+		}
 	}
-
-	n = read(connfd, msg, sizeof msg);
-	if (n != sizeof msg) {
-		perror("server read");
-		fprintf(stderr, "%d/%d: Couldn't read remote address\n", n, (int) sizeof msg);
-		goto out;
+	if (err) {
+		fprintf(stderr, "Couldn't close the stream\n");
+		return 1;
 	}
 
-	rem_dest = malloc(sizeof *rem_dest);
-	if (!rem_dest)
-		goto out;
+	while (ctx->send_buf.used) {
+		if (stream_progress(ctx) < 0) {
+			return 1;
+		}
+	}
 
-	sscanf(msg, "%x:%x:%x:%s", &rem_dest->lid, &rem_dest->qpn, &rem_dest->psn, gid);
-	wire_gid_to_gid(gid, &rem_dest->gid);
+	return 0;
+}
 
-//	if (stream_connect_ctx(ctx, ib_port, my_dest->psn, mtu, sl, rem_dest, sgid_idx)) {
-//		fprintf(stderr, "Couldn't connect to remote QP\n");
-//		free(rem_dest);
-//		rem_dest = NULL;
-//		goto out;
-//	}
+/**
+ * A thread sending its share of the messages on its own lane
+ */
+struct stream_client_lane {
+	struct stream_connect_ctx *ctx;
+	pthread_t thread;
+	uint8_t *buf;
+	uint64_t len;
+	int count;
+	int failed;
+};
+
+static void *stream_client_run_lane(void *arg) {
+	struct stream_client_lane *lane = arg;
+
+	lane->failed = stream_client_send(lane->ctx, lane->buf, lane->len, lane->count);
+	return NULL;
+}
 
+/**
+ * Send count messages striped over all the lanes from this thread, then
+ * close the lanes. Returns 1 on failure.
+ */
+static int stream_client_stripe(struct stream_lanes *group, uint8_t *buf, uint64_t len,
+		int count) {
+	int sent = 0, err, i;
+
+	while (sent < count) {
+		err = stream_lanes_send(group, buf, len);
+		if (err == 0) {
+			++sent;
+			continue;
+		} else if (err != EAGAIN) {
+			fprintf(stderr, "Couldn't post send\n");
+			return 1;
+		}
 
-	gid_to_wire_gid(&my_dest->gid, gid);
-	sprintf(msg, "%04x:%06x:%06x:%s", my_dest->lid, my_dest->qpn, my_dest->psn, gid);
-	if (write(connfd, msg, sizeof msg) != sizeof msg) {
-		fprintf(stderr, "Couldn't send local address\n");
-		free(rem_dest);
-		rem_dest = NULL;
-		goto out;
+		// every lane is full, the completions make room
+		for (i = 0; i < group->no_lanes; ++i) {
+			if (stream_progress(group->lanes[i]) < 0) {
+				return 1;
+			}
+		}
 	}
 
-	read(connfd, msg, sizeof msg);
-
-out:
-	close(connfd);
-	return rem_dest;
+	for (i = 0; i < group->no_lanes; ++i) {
+		if (stream_client_send(group->lanes[i], buf, 0, 0)) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
-
 static void usage(const char *argv0) {
 	printf("Usage:\n");
-	printf("  %s            start a server and wait for connection\n", argv0);
 	printf("  %s <host>     connect to server at <host>\n", argv0);
 	printf("\n");
 	printf("Options:\n");
 	printf("  -p, --port=<port>      listen on/connect to port <port> (default 18515)\n");
-	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default the one on the node the\n");
+	printf("                         process is bound to, else the first found)\n");
 	printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
 	printf("  -s, --size=<size>      size of message to exchange (default 4096)\n");
 	printf("  -m, --mtu=<size>       path MTU (default 1024)\n");
-	printf("  -r, --rx-depth=<dep>   number of receives to post at a time (default 500)\n");
-	printf("  -n, --iters=<iters>    number of exchanges (default 1000)\n");
+	printf("  -r, --rx-depth=<dep>   number of receives to post at a time (default 12)\n");
+	printf("  -t, --tx-depth=<dep>   number of sends outstanding at a time (default 16)\n");
+	printf("  -c, --signal=<n>       ask for a completion every n sends (default 1)\n");
+	printf("  -I, --inline=<size>    max size of message to send inline (default 256)\n");
+	printf("  -w, --rx-watermark=<n> refill receives when n are left posted (default rx-depth / 2)\n");
+	printf("  -n, --iters=<iters>    number of messages to send (default 1000)\n");
 	printf("  -l, --sl=<sl>          service level value\n");
 	printf("  -e, --events           sleep on CQ events (default poll)\n");
+	printf("  -a, --adaptive         poll while busy, sleep on CQ events once idle\n");
+	printf("  -b, --spin=<n>         empty polls before sleeping with -a (default tuned)\n");
+	printf("  -P, --poll-batch=<n>   completions taken per poll, up to 64 (default 16)\n");
+	printf("  -T, --producers=<n>    queue the messages from n threads (default 0, send directly)\n");
+	printf("  -L, --lanes=<n>        send from n threads, each on its own connection (default 1)\n");
+	printf("  -M, --merge            deliver the lanes in the order they were sent (default per lane)\n");
+	printf("  -x, --stripe           send from one thread striped over the lanes, implies -M\n");
+	printf("  -z, --msg-size=<size>  size of the messages striped with -x (default one buffer)\n");
+	printf("  -R, --rails=<dev:port,..> spread the lanes over these device and port pairs,\n");
+	printf("                         traffic in proportion to the port rates, with -M or -x\n");
+	printf("                         the ports of one device\n");
 	printf("  -g, --gid-idx=<gid index> local port gid index\n");
 }
 
@@ -205,16 +190,20 @@ int main(int argc, char *argv[]) {
 	struct timeval start, end;
 
 	int iters = 1000;
-	int routs;
-	int rcnt, scnt;
-	int num_cq_events = 0;
+	int ne, i;
+	int no_producers = 0;
+	int no_lanes = 1, merge = 0, stripe = 0;
+	uint64_t msg_size = 0;
+	struct stream_rail rails[STREAM_MAX_RAILS];
+	int no_rails = 0;
+	long long weight;
+	struct stream_client_producer *producers = NULL;
+	struct stream_client_lane *lanes = NULL;
+	struct stream_lanes *group = NULL;
 	char gid[33];
+	uint8_t *buf;
 
 	struct stream_connect_cfg cfg;
-	ctx = calloc(1, sizeof *ctx);
-	if (!ctx) {
-		return 1;
-	}
 	stream_init_cfg(&cfg);
 
 	srand48(getpid() * time(NULL));
@@ -229,14 +218,27 @@ int main(int argc, char *argv[]) {
 				{ .name = "size",     .has_arg = 1, .val = 's' },
 				{ .name = "mtu",      .has_arg = 1, .val = 'm' },
 				{ .name = "rx-depth", .has_arg = 1, .val = 'r' },
+				{ .name = "tx-depth", .has_arg = 1, .val = 't' },
+				{ .name = "signal",   .has_arg = 1, .val = 'c' },
+				{ .name = "inline",   .has_arg = 1, .val = 'I' },
+				{ .name = "rx-watermark", .has_arg = 1, .val = 'w' },
 				{ .name = "iters",    .has_arg = 1, .val = 'n' },
 				{ .name = "sl",       .has_arg = 1, .val = 'l' },
 				{ .name = "events",   .has_arg = 0, .val = 'e' },
+				{ .name = "adaptive", .has_arg = 0, .val = 'a' },
+				{ .name = "spin",     .has_arg = 1, .val = 'b' },
+				{ .name = "poll-batch", .has_arg = 1, .val = 'P' },
+				{ .name = "producers", .has_arg = 1, .val = 'T' },
+				{ .name = "lanes",    .has_arg = 1, .val = 'L' },
+				{ .name = "merge",    .has_arg = 0, .val = 'M' },
+				{ .name = "stripe",   .has_arg = 0, .val = 'x' },
+				{ .name = "msg-size", .has_arg = 1, .val = 'z' },
+				{ .name = "rails",    .has_arg = 1, .val = 'R' },
 				{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
 				{ 0 }
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:s:m:r:t:c:I:w:n:l:eab:P:T:L:Mxz:R:g:", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -277,6 +279,22 @@ int main(int argc, char *argv[]) {
 			cfg.rx_depth = strtol(optarg, NULL, 0);
 			break;
 
+		case 't':
+			cfg.tx_depth = strtol(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			cfg.signal_interval = strtol(optarg, NULL, 0);
+			break;
+
+		case 'I':
+			cfg.max_inline = strtol(optarg, NULL, 0);
+			break;
+
+		case 'w':
+			cfg.rx_watermark = strtol(optarg, NULL, 0);
+			break;
+
 		case 'n':
 			iters = strtol(optarg, NULL, 0);
 			break;
@@ -289,6 +307,47 @@ int main(int argc, char *argv[]) {
 			++cfg.use_event;
 			break;
 
+		case 'a':
+			cfg.adaptive = 1;
+			break;
+
+		case 'b':
+			cfg.spin_budget = strtol(optarg, NULL, 0);
+			break;
+
+		case 'P':
+			cfg.poll_batch = strtol(optarg, NULL, 0);
+			break;
+
+		case 'T':
+			no_producers = strtol(optarg, NULL, 0);
+			break;
+
+		case 'L':
+			no_lanes = strtol(optarg, NULL, 0);
+			break;
+
+		case 'M':
+			merge = 1;
+			break;
+
+		case 'x':
+			stripe = 1;
+			merge = 1;
+			break;
+
+		case 'z':
+			msg_size = strtoull(optarg, NULL, 0);
+			break;
+
+		case 'R':
+			no_rails = stream_parse_rails(optarg, rails, STREAM_MAX_RAILS);
+			if (no_rails < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		case 'g':
 			cfg.gidx = strtol(optarg, NULL, 0);
 			break;
@@ -301,146 +360,146 @@ int main(int argc, char *argv[]) {
 
 	if (optind == argc - 1)
 		cfg.servername = strdup(argv[optind]);
-	else if (optind < argc) {
+	else {
 		usage(argv[0]);
 		return 1;
 	}
 
 	cfg.page_size = sysconf(_SC_PAGESIZE);
-
-	if (stream_assign_device(&cfg, ctx)) {
-		fprintf(stderr, "Failed to get infiniband device\n");
+	// at least a lane over every rail
+	if (no_lanes < no_rails) {
+		no_lanes = no_rails;
+	}
+	if (no_lanes > 1 && no_producers > 0) {
+		fprintf(stderr, "Lanes and producers can't be used together\n");
 		return 1;
 	}
-
-	if (stream_init_ctx(&cfg, ctx)) {
-		fprintf(stderr, "Failed to initialize context\n");
+	if (stripe && no_lanes < 2) {
+		fprintf(stderr, "Striping needs at least 2 lanes\n");
 		return 1;
 	}
+	// one poller merges all the lanes, and it only drives the queues of one
+	// device, on either end
+	for (i = 1; merge && i < no_rails; ++i) {
+		if (strcmp(rails[i].devname, rails[0].devname)) {
+			fprintf(stderr, "Merged lanes need rails on the ports of one device\n");
+			return 1;
+		}
+	}
+	if (no_producers > 0) {
+		cfg.submit_depth = cfg.tx_depth * 4;
+	}
+	if (!stripe || !msg_size) {
+		msg_size = cfg.size - STREAM_MESSAGE_OVERHEAD;
+	}
 
-	routs = stream_post_recv(ctx, ctx->rx_depth);
-	if (routs < ctx->rx_depth) {
-		fprintf(stderr, "Couldn't post receive (%d)\n", routs);
-		return 1;
+	if (no_lanes > 1) {
+		group = stream_lanes_connect(&cfg, rails, no_rails, no_lanes, merge);
+		if (!group) {
+			return 1;
+		}
+		ctx = group->lanes[0];
+	} else {
+		ctx = stream_connect(&cfg);
+		if (!ctx) {
+			return 1;
+		}
 	}
 
 	inet_ntop(AF_INET6, &ctx->self_dest.gid, gid, sizeof gid);
 	printf("  local address:  LID 0x%04x, QPN 0x%06x, PSN 0x%06x, GID %s\n",
 			ctx->self_dest.lid, ctx->self_dest.qpn, ctx->self_dest.psn, gid);
 
-
-	if (cfg.servername)
-		ctx->rem_dest = stream_client_exch_dest(cfg.servername, cfg.port, &ctx->self_dest);
-	else
-		ctx->rem_dest = stream_server_exch_dest(ctx, cfg.ib_port, cfg.mtu, cfg.port, cfg.sl, &ctx->self_dest, cfg.gidx);
-
-	if (!ctx->rem_dest) {
-		return 1;
-	}
-
 	inet_ntop(AF_INET6, &ctx->rem_dest->gid, gid, sizeof gid);
 	printf("  remote address: LID 0x%04x, QPN 0x%06x, PSN 0x%06x, GID %s\n",
 			ctx->rem_dest->lid, ctx->rem_dest->qpn, ctx->rem_dest->psn, gid);
 
-	if (cfg.servername)
-		if (stream_connect_ctx(&cfg, ctx))
-			return 1;
-
-	ctx->pending = STREAM_RECV_WRID;
-
-	if (cfg.servername) {
-		if (stream_post_send(ctx)) {
-			fprintf(stderr, "Couldn't post send\n");
-			return 1;
-		}
-		ctx->pending |= STREAM_SEND_WRID;
+	buf = calloc(1, MAX((uint64_t) cfg.size, msg_size));
+	if (!buf) {
+		return 1;
 	}
+	memset(buf, 0x7b, msg_size);
 
 	if (gettimeofday(&start, NULL)) {
 		perror("gettimeofday");
 		return 1;
 	}
 
-	rcnt = scnt = 0;
-	while (rcnt < iters || scnt < iters) {
-		if (cfg.use_event) {
-			struct ibv_cq *ev_cq;
-			void          *ev_ctx;
-
-			if (ibv_get_cq_event(ctx->channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get cq_event\n");
-				return 1;
-			}
-
-			++num_cq_events;
+	if (no_producers > 0) {
+		producers = calloc(no_producers, sizeof (struct stream_client_producer));
+		if (!producers) {
+			return 1;
+		}
 
-			if (ev_cq != ctx->cq) {
-				fprintf(stderr, "CQ event for unknown CQ %p\n", ev_cq);
+		for (i = 0; i < no_producers; ++i) {
+			producers[i].ctx = ctx;
+			producers[i].buf = buf;
+			producers[i].len = cfg.size - STREAM_MESSAGE_OVERHEAD;
+			producers[i].count = iters / no_producers + (i < iters % no_producers);
+			if (pthread_create(&producers[i].thread, NULL, stream_client_produce,
+					&producers[i])) {
+				fprintf(stderr, "Couldn't start producer\n");
 				return 1;
 			}
+		}
 
-			if (ibv_req_notify_cq(ctx->cq, 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
+		// every message taken off the queue has been posted
+		while (__atomic_load_n(&ctx->submit->dequeue_pos, __ATOMIC_RELAXED) < (uint32_t) iters) {
+			ne = stream_progress(ctx);
+			if (ne < 0 || stream_idle(ctx, ne)) {
 				return 1;
 			}
-		}
 
-		{
-			struct ibv_wc wc[2];
-			int ne, i;
-			do {
-				ne = ibv_poll_cq(ctx->cq, 2, wc);
-				if (ne < 0) {
-					fprintf(stderr, "poll CQ failed %d\n", ne);
+			for (i = 0; i < no_producers; ++i) {
+				if (producers[i].failed) {
+					fprintf(stderr, "Couldn't queue send\n");
 					return 1;
 				}
+			}
+		}
 
-			} while (!cfg.use_event && ne < 1);
+		for (i = 0; i < no_producers; ++i) {
+			pthread_join(producers[i].thread, NULL);
+		}
+		free(producers);
+	}
 
-			for (i = 0; i < ne; ++i) {
-				if (wc[i].status != IBV_WC_SUCCESS) {
-					fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-							ibv_wc_status_str(wc[i].status),
-							wc[i].status, (int) wc[i].wr_id);
-					return 1;
-				}
+	if (group && stripe) {
+		if (stream_client_stripe(group, buf, msg_size, iters)) {
+			return 1;
+		}
+	} else if (group) {
+		lanes = calloc(no_lanes, sizeof (struct stream_client_lane));
+		if (!lanes) {
+			return 1;
+		}
 
-				switch ((int) wc[i].wr_id) {
-				case STREAM_SEND_WRID:
-					++scnt;
-					break;
-
-				case STREAM_RECV_WRID:
-					if (--routs <= 1) {
-						routs += stream_post_recv(ctx, ctx->rx_depth - routs);
-						if (routs < ctx->rx_depth) {
-							fprintf(stderr,
-									"Couldn't post receive (%d)\n",
-									routs);
-							return 1;
-						}
-					}
-
-					++rcnt;
-					break;
-
-				default:
-					fprintf(stderr, "Completion for unknown wr_id %d\n",
-							(int) wc[i].wr_id);
-					return 1;
-				}
+		// each lane sends its share by the rate of its port, rounded so the
+		// shares add up to iters
+		weight = 0;
+		for (i = 0; i < no_lanes; ++i) {
+			lanes[i].ctx = group->lanes[i];
+			lanes[i].buf = buf;
+			lanes[i].len = cfg.size - STREAM_MESSAGE_OVERHEAD;
+			lanes[i].count = (long long) iters * (weight + group->weight[i]) /
+					group->total_weight - (long long) iters * weight / group->total_weight;
+			weight += group->weight[i];
+			if (pthread_create(&lanes[i].thread, NULL, stream_client_run_lane, &lanes[i])) {
+				fprintf(stderr, "Couldn't start lane\n");
+				return 1;
+			}
+		}
 
-				ctx->pending &= ~(int) wc[i].wr_id;
-				if (scnt < iters && !ctx->pending) {
-					if (stream_post_send(ctx)) {
-						fprintf(stderr, "Couldn't post send\n");
-						return 1;
-					}
-					ctx->pending = STREAM_RECV_WRID |
-							STREAM_SEND_WRID;
-				}
+		for (i = 0; i < no_lanes; ++i) {
+			pthread_join(lanes[i].thread, NULL);
+			if (lanes[i].failed) {
+				return 1;
 			}
 		}
+		free(lanes);
+	} else if (stream_client_send(ctx, buf, cfg.size - STREAM_MESSAGE_OVERHEAD,
+			no_producers > 0 ? 0 : iters)) {
+		return 1;
 	}
 
 	if (gettimeofday(&end, NULL)) {
@@ -451,7 +510,7 @@ int main(int argc, char *argv[]) {
 	{
 		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
 				(end.tv_usec - start.tv_usec);
-		long long bytes = (long long) cfg.size * iters * 2;
+		long long bytes = (long long) (msg_size + STREAM_MESSAGE_OVERHEAD) * iters;
 
 		printf("%lld bytes in %.2f seconds = %.2f Mbit/sec\n",
 				bytes, usec / 1000000., bytes * 8. / usec);
@@ -459,12 +518,12 @@ int main(int argc, char *argv[]) {
 				iters, usec / 1000000., usec / iters);
 	}
 
-	ibv_ack_cq_events(ctx->cq, num_cq_events);
-
+	free(buf);
+	if (group) {
+		return stream_lanes_close(group);
+	}
 	if (stream_close_ctx(ctx))
 		return 1;
 
-	free(ctx->rem_dest);
-
 	return 0;
 }
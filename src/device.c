@@ -0,0 +1,804 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#include "device.h"
+#include "srq.h"
+
+// devices opened so far, guarded by devices_lock
+static struct stream_device *devices;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+// creation of the shared queues, the SRQ needs devices_lock for its memory
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// memory policies of mbind and set_mempolicy, called directly so there is
+// no need for libnuma
+#define STREAM_MPOL_PREFERRED 1
+#define STREAM_MPOL_MF_MOVE (1 << 1)
+
+// hugepage sizes asked of MAP_HUGETLB, older headers lack them
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define STREAM_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define STREAM_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#define STREAM_2MB (2UL << 20)
+#define STREAM_1GB (1UL << 30)
+
+/**
+ * NUMA node a device is attached to, -1 if the system doesn't say
+ */
+static int stream_device_numa_node(struct ibv_device *device) {
+	char path[IBV_SYSFS_PATH_MAX + 32];
+	FILE *file;
+	int node = -1;
+
+	snprintf(path, sizeof path, "%s/device/numa_node", device->ibdev_path);
+	file = fopen(path, "r");
+	if (!file) {
+		return -1;
+	}
+	if (fscanf(file, "%d", &node) != 1 || node >= STREAM_MAX_NODES) {
+		node = -1;
+	}
+	fclose(file);
+	return node;
+}
+
+/**
+ * NUMA node of a core, -1 if unknown
+ */
+static int stream_cpu_node(int cpu) {
+	char path[64];
+	struct dirent *entry;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir) {
+		return -1;
+	}
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1) {
+			break;
+		}
+		node = -1;
+	}
+	closedir(dir);
+	return node;
+}
+
+/**
+ * NUMA node all the cores the process may run on belong to, -1 if they span
+ * several or it is unknown. The core the caller happens to run on says
+ * nothing about where the process will run.
+ */
+static int stream_affinity_node(void) {
+	cpu_set_t cpus;
+	int cpu, node = -1, cpu_node;
+
+	if (sched_getaffinity(0, sizeof cpus, &cpus)) {
+		return -1;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &cpus)) {
+			continue;
+		}
+		cpu_node = stream_cpu_node(cpu);
+		if (cpu_node < 0 || (node >= 0 && cpu_node != node)) {
+			return -1;
+		}
+		node = cpu_node;
+	}
+	return node;
+}
+
+void stream_device_prefer(struct stream_device *dev, struct stream_mempolicy *old) {
+	unsigned long mask[STREAM_MAX_NODES / (8 * sizeof (unsigned long))] = { 0 };
+
+	old->saved = 0;
+	if (dev->numa_node < 0) {
+		return;
+	}
+
+	// the application may have a policy of its own for the thread
+	if (syscall(SYS_get_mempolicy, &old->mode, old->mask, STREAM_MAX_NODES, NULL, 0)) {
+		return;
+	}
+	mask[dev->numa_node / (8 * sizeof (unsigned long))] |=
+			1UL << (dev->numa_node % (8 * sizeof (unsigned long)));
+	old->saved = !syscall(SYS_set_mempolicy, STREAM_MPOL_PREFERRED, mask, STREAM_MAX_NODES);
+}
+
+void stream_device_unprefer(struct stream_device *dev, struct stream_mempolicy *old) {
+	(void) dev;
+	if (old->saved) {
+		syscall(SYS_set_mempolicy, old->mode, old->mask, STREAM_MAX_NODES);
+		old->saved = 0;
+	}
+}
+
+/**
+ * Move the pages of buf to the node of the device, pages not touched yet are
+ * placed there when they are. Fails quietly, the memory works anywhere.
+ */
+static void stream_device_bind(struct stream_device *dev, void *buf, size_t size) {
+	unsigned long mask[STREAM_MAX_NODES / (8 * sizeof (unsigned long))] = { 0 };
+
+	if (dev->numa_node < 0) {
+		return;
+	}
+	mask[dev->numa_node / (8 * sizeof (unsigned long))] |=
+			1UL << (dev->numa_node % (8 * sizeof (unsigned long)));
+	syscall(SYS_mbind, buf, size, STREAM_MPOL_PREFERRED, mask, STREAM_MAX_NODES,
+			STREAM_MPOL_MF_MOVE);
+}
+
+/**
+ * Open the device, the caller holds devices_lock
+ */
+static struct stream_device *stream_device_open(const char *name) {
+	struct stream_device *dev;
+	struct ibv_device **dev_list;
+	int i, node = -1;
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return NULL;
+	}
+
+	// DMA to the memory of the other socket costs bandwidth, so without a
+	// name the device next to the cores we are bound to goes first. Bound to
+	// no node in particular, the first device it is, as before.
+	if (!name) {
+		node = stream_affinity_node();
+	}
+	for (i = 0; dev_list[i]; ++i) {
+		if (name ? !strcmp(ibv_get_device_name(dev_list[i]), name) :
+				node < 0 || stream_device_numa_node(dev_list[i]) == node) {
+			break;
+		}
+	}
+	if (!name && !dev_list[i]) {
+		i = 0;
+	}
+
+	if (!dev_list[i]) {
+		if (name) {
+			fprintf(stderr, "IB device %s not found\n", name);
+		} else {
+			fprintf(stderr, "No IB devices found\n");
+		}
+		ibv_free_device_list(dev_list);
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof *dev);
+	if (!dev) {
+		fprintf(stderr, "Couldn't allocate device\n");
+		ibv_free_device_list(dev_list);
+		return NULL;
+	}
+	dev->dev_list = dev_list;
+	dev->device = dev_list[i];
+	dev->numa_node = stream_device_numa_node(dev->device);
+
+	dev->context = ibv_open_device(dev->device);
+	if (!dev->context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+				ibv_get_device_name(dev->device));
+		goto error;
+	}
+
+	dev->pd = ibv_alloc_pd(dev->context);
+	if (!dev->pd) {
+		fprintf(stderr, "Couldn't allocate PD\n");
+		goto error;
+	}
+
+	return dev;
+
+	error:
+	if (dev->context) {
+		ibv_close_device(dev->context);
+	}
+	ibv_free_device_list(dev_list);
+	free(dev);
+	return NULL;
+}
+
+/**
+ * Map size bytes, rounded up to the page size used. Explicit hugepages are
+ * tried first, 1GB ones for a large mapping, then transparent hugepages on
+ * an aligned normal mapping. Less than a hugepage is mapped with normal
+ * pages, rounding it up would only pin memory no one uses. Returns NULL on
+ * failure.
+ */
+static void *stream_arena_map(size_t *size) {
+	size_t len;
+	uint8_t *buf, *aligned;
+
+	if (*size < STREAM_2MB) {
+		len = roundup(*size, (size_t) sysconf(_SC_PAGESIZE));
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			perror("mmap");
+			return NULL;
+		}
+		*size = len;
+		return buf;
+	}
+
+	if (*size >= STREAM_1GB) {
+		len = roundup(*size, STREAM_1GB);
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | STREAM_HUGE_1GB, -1, 0);
+		if (buf != MAP_FAILED) {
+			*size = len;
+			return buf;
+		}
+	}
+
+	len = roundup(*size, STREAM_2MB);
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | STREAM_HUGE_2MB, -1, 0);
+	if (buf != MAP_FAILED) {
+		*size = len;
+		return buf;
+	}
+
+	// no hugepages reserved, map a 2MB more and trim it to a 2MB boundary
+	// so the kernel can back it with transparent ones
+	buf = mmap(NULL, len + STREAM_2MB, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	aligned = (uint8_t *) roundup((uintptr_t) buf, STREAM_2MB);
+	if (aligned > buf) {
+		munmap(buf, aligned - buf);
+	}
+	munmap(aligned + len, buf + STREAM_2MB - aligned);
+	madvise(aligned, len, MADV_HUGEPAGE);
+
+	*size = len;
+	return aligned;
+}
+
+static int stream_arena_destroy(struct stream_arena *arena) {
+	if (arena->mr && ibv_dereg_mr(arena->mr)) {
+		fprintf(stderr, "Couldn't deregister MR\n");
+		return 1;
+	}
+
+	munmap(arena->base, arena->size);
+	free(arena);
+	return 0;
+}
+
+/**
+ * Create an arena of at least size bytes for the device. Faulting in and
+ * registering take a while, so this runs without devices_lock and the caller
+ * links the arena in after. Returns NULL on failure.
+ */
+static struct stream_arena *stream_arena_create(struct stream_device *dev, size_t size,
+		int dedicated) {
+	struct stream_arena *arena;
+
+	arena = calloc(1, sizeof *arena);
+	if (!arena) {
+		fprintf(stderr, "Couldn't allocate arena\n");
+		return NULL;
+	}
+	arena->dedicated = dedicated;
+
+	arena->size = size;
+	arena->base = stream_arena_map(&arena->size);
+	if (!arena->base) {
+		free(arena);
+		return NULL;
+	}
+
+	// fault every page in on the node of the device now rather than on the
+	// first send, and keep them there. The registration pins them as well,
+	// so a lock over the limit is no reason to fail.
+	stream_device_bind(dev, arena->base, arena->size);
+	memset(arena->base, 0x7b, arena->size);
+	mlock(arena->base, arena->size);
+
+	arena->mr = ibv_reg_mr(dev->pd, arena->base, arena->size, IBV_ACCESS_LOCAL_WRITE);
+	if (!arena->mr) {
+		fprintf(stderr, "Couldn't register MR of %lu bytes\n", (unsigned long) arena->size);
+		stream_arena_destroy(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+static void stream_arena_link(struct stream_device *dev, struct stream_arena *arena) {
+	pthread_mutex_lock(&devices_lock);
+	arena->next = dev->arenas;
+	dev->arenas = arena;
+	pthread_mutex_unlock(&devices_lock);
+}
+
+static struct stream_mem *stream_arena_region(struct stream_arena *arena, size_t offset,
+		size_t size) {
+	struct stream_mem *mem;
+
+	mem = calloc(1, sizeof *mem);
+	if (!mem) {
+		fprintf(stderr, "Couldn't allocate memory region\n");
+		return NULL;
+	}
+	mem->buf = (uint8_t *) arena->base + offset;
+	mem->size = size;
+	mem->mr = arena->mr;
+	mem->arena = arena;
+	arena->used = offset + size;
+	return mem;
+}
+
+/**
+ * Size class of a region carved from a reserved arena, the smallest power of
+ * 2 that holds size
+ */
+static int stream_mem_class(size_t size) {
+	int c = 0;
+
+	while (((size_t) 1 << c) < size) {
+		c++;
+	}
+	return c;
+}
+
+/**
+ * Carve a region off a shared arena, reusing a released one of the same size
+ * class first. Regions are rounded up to their class so one released by a
+ * connection serves the next whatever its exact size. The caller holds
+ * devices_lock. Returns NULL if no arena has room.
+ */
+static struct stream_mem *stream_arena_carve(struct stream_device *dev, size_t size,
+		size_t align) {
+	struct stream_arena *arena;
+	struct stream_mem *mem, **prev;
+	int c = stream_mem_class(size), shared = 0;
+	size_t offset;
+
+	if (c >= STREAM_MEM_CLASSES) {
+		return NULL;
+	}
+
+	for (prev = &dev->carved[c]; (mem = *prev); prev = &mem->next) {
+		if (((uintptr_t) mem->buf % align) == 0) {
+			*prev = mem->next;
+			return mem;
+		}
+	}
+
+	size = (size_t) 1 << c;
+	for (arena = dev->arenas; arena; arena = arena->next) {
+		if (arena->dedicated) {
+			continue;
+		}
+		shared = 1;
+		offset = roundup(arena->used, align);
+		if (offset + size <= arena->size) {
+			return stream_arena_region(arena, offset, size);
+		}
+	}
+
+	if (shared && !dev->reserve_full) {
+		fprintf(stderr, "Reserved memory used up, more regions get a mapping of their own\n");
+		dev->reserve_full = 1;
+	}
+	return NULL;
+}
+
+/**
+ * A region of its own registration, for when no arena can be had, e.g. the
+ * lock limit leaves no room for a hugepage worth. Returns NULL on failure.
+ */
+static struct stream_mem *stream_mem_plain(struct stream_device *dev, size_t size,
+		size_t align) {
+	struct stream_mem *mem;
+
+	mem = calloc(1, sizeof *mem);
+	if (!mem) {
+		fprintf(stderr, "Couldn't allocate memory region\n");
+		return NULL;
+	}
+	mem->size = size;
+
+	if (posix_memalign(&mem->buf, align, size)) {
+		fprintf(stderr, "Couldn't allocate work buf\n");
+		free(mem);
+		return NULL;
+	}
+	stream_device_bind(dev, mem->buf, size);
+	memset(mem->buf, 0x7b, size);
+
+	mem->mr = ibv_reg_mr(dev->pd, mem->buf, size, IBV_ACCESS_LOCAL_WRITE);
+	if (!mem->mr) {
+		fprintf(stderr, "Couldn't register MR\n");
+		free(mem->buf);
+		free(mem);
+		return NULL;
+	}
+	return mem;
+}
+
+/**
+ * Release a region for good, a dedicated arena goes with it. The caller holds
+ * devices_lock.
+ */
+static int stream_mem_free(struct stream_device *dev, struct stream_mem *mem) {
+	struct stream_arena **prev;
+
+	if (!mem->arena) {
+		if (ibv_dereg_mr(mem->mr)) {
+			fprintf(stderr, "Couldn't deregister MR\n");
+			return 1;
+		}
+		free(mem->buf);
+	} else if (mem->arena->dedicated) {
+		for (prev = &dev->arenas; *prev != mem->arena; prev = &(*prev)->next);
+		*prev = mem->arena->next;
+		if (stream_arena_destroy(mem->arena)) {
+			return 1;
+		}
+	}
+
+	free(mem);
+	return 0;
+}
+
+/**
+ * Close the device and everything cached on it, no one else can reach it
+ */
+static int stream_device_close(struct stream_device *dev) {
+	struct stream_mem *mem;
+	struct stream_arena *arena;
+	int i;
+
+	// gives its memory back to the cache, so it goes first
+	if (stream_srq_destroy(dev->srq)) {
+		return 1;
+	}
+
+	for (i = 0; i < STREAM_MAX_SHARDS; ++i) {
+		if (dev->cqs[i].cq && ibv_destroy_cq(dev->cqs[i].cq)) {
+			fprintf(stderr, "Couldn't destroy CQ\n");
+			return 1;
+		}
+
+		if (dev->cqs[i].channel && ibv_destroy_comp_channel(dev->cqs[i].channel)) {
+			fprintf(stderr, "Couldn't destroy completion channel\n");
+			return 1;
+		}
+	}
+
+	while ((mem = dev->free_mems)) {
+		dev->free_mems = mem->next;
+		if (stream_mem_free(dev, mem)) {
+			return 1;
+		}
+	}
+
+	for (i = 0; i < STREAM_MEM_CLASSES; ++i) {
+		while ((mem = dev->carved[i])) {
+			dev->carved[i] = mem->next;
+			free(mem);
+		}
+	}
+
+	while ((arena = dev->arenas)) {
+		dev->arenas = arena->next;
+		if (stream_arena_destroy(arena)) {
+			return 1;
+		}
+	}
+
+	if (ibv_dealloc_pd(dev->pd)) {
+		fprintf(stderr, "Couldn't deallocate PD\n");
+		return 1;
+	}
+
+	if (ibv_close_device(dev->context)) {
+		fprintf(stderr, "Couldn't release context\n");
+		return 1;
+	}
+
+	ibv_free_device_list(dev->dev_list);
+	free(dev);
+	return 0;
+}
+
+struct stream_device *stream_device_get(const char *name) {
+	struct stream_device *dev;
+
+	pthread_mutex_lock(&devices_lock);
+	for (dev = devices; dev; dev = dev->next) {
+		if (!name || !strcmp(ibv_get_device_name(dev->device), name)) {
+			break;
+		}
+	}
+
+	if (!dev) {
+		dev = stream_device_open(name);
+		if (dev) {
+			dev->next = devices;
+			devices = dev;
+		}
+	}
+
+	if (dev) {
+		dev->ref++;
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	return dev;
+}
+
+int stream_device_put(struct stream_device *dev) {
+	struct stream_device **prev;
+	int last;
+
+	if (!dev) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&devices_lock);
+	last = --dev->ref == 0;
+	if (last) {
+		for (prev = &devices; *prev != dev; prev = &(*prev)->next);
+		*prev = dev->next;
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	// unlinked, so it can be closed without holding the lock
+	return last ? stream_device_close(dev) : 0;
+}
+
+struct stream_srq *stream_device_srq(struct stream_device *dev, uint32_t size,
+		uint32_t buf_size, uint32_t limit, size_t align) {
+	struct stream_srq *srq;
+
+	pthread_mutex_lock(&queue_lock);
+	if (!dev->srq) {
+		dev->srq = stream_srq_create(dev, size, buf_size, limit, align);
+	}
+	srq = dev->srq;
+	pthread_mutex_unlock(&queue_lock);
+
+	if (srq && srq->buf_size < buf_size) {
+		fprintf(stderr, "SRQ buffers of %u can't hold %u\n", srq->buf_size, buf_size);
+		return NULL;
+	}
+
+	return srq;
+}
+
+int stream_device_comp_vector(struct stream_device *dev, int n) {
+	return dev->context->num_comp_vectors > 0 ? n % dev->context->num_comp_vectors : 0;
+}
+
+struct ibv_cq *stream_device_cq(struct stream_device *dev, int shard, int cqe,
+		int use_event) {
+	struct stream_device_cq *shared;
+	struct ibv_cq *cq = NULL;
+	struct stream_mempolicy policy;
+	int depth;
+
+	if (shard < 0 || shard >= STREAM_MAX_SHARDS) {
+		fprintf(stderr, "No shared CQ %d, at most %d\n", shard, STREAM_MAX_SHARDS);
+		return NULL;
+	}
+	shared = &dev->cqs[shard];
+
+	pthread_mutex_lock(&queue_lock);
+	if (!shared->cq) {
+		if (use_event && !shared->channel) {
+			shared->channel = ibv_create_comp_channel(dev->context);
+			if (!shared->channel) {
+				fprintf(stderr, "Couldn't create completion channel\n");
+				goto out;
+			}
+		}
+
+		// each shard interrupts on its own vector, so the events of the
+		// pollers land on different cores
+		stream_device_prefer(dev, &policy);
+		shared->cq = ibv_create_cq(dev->context, MAX(cqe, STREAM_CQ_MIN_DEPTH), NULL,
+				shared->channel, stream_device_comp_vector(dev, shard));
+		stream_device_unprefer(dev, &policy);
+		if (!shared->cq) {
+			fprintf(stderr, "Couldn't create CQ\n");
+			goto out;
+		}
+
+		if (shared->channel && ibv_req_notify_cq(shared->cq, 0)) {
+			fprintf(stderr, "Couldn't request CQ notification\n");
+			goto out;
+		}
+	}
+
+	// an overrun loses completions for every connection, so grow ahead of it
+	if (shared->reserved + cqe > shared->cq->cqe) {
+		depth = shared->cq->cqe;
+		while (depth < shared->reserved + cqe) {
+			depth *= 2;
+		}
+		stream_device_prefer(dev, &policy);
+		if (ibv_resize_cq(shared->cq, depth)) {
+			stream_device_unprefer(dev, &policy);
+			fprintf(stderr, "Couldn't resize CQ to %d\n", depth);
+			goto out;
+		}
+		stream_device_unprefer(dev, &policy);
+	}
+	shared->reserved += cqe;
+	cq = shared->cq;
+
+	out:
+	pthread_mutex_unlock(&queue_lock);
+	return cq;
+}
+
+void stream_device_cq_release(struct stream_device *dev, int shard, int cqe) {
+	pthread_mutex_lock(&queue_lock);
+	dev->cqs[shard].reserved -= cqe;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+struct stream_mem *stream_mem_get(struct stream_device *dev, size_t size, size_t align) {
+	struct stream_arena *arena;
+	struct stream_mem *mem, **prev;
+
+	// connections mostly ask for the same size, take the first that fits
+	pthread_mutex_lock(&devices_lock);
+	for (prev = &dev->free_mems; (mem = *prev); prev = &mem->next) {
+		if (mem->size == size && ((uintptr_t) mem->buf % align) == 0) {
+			*prev = mem->next;
+			dev->no_free_mems--;
+			break;
+		}
+	}
+
+	if (!mem) {
+		mem = stream_arena_carve(dev, size, align);
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	// nothing reserved has room, the region gets an arena sized to it
+	if (!mem) {
+		arena = stream_arena_create(dev, size, 1);
+		if (arena) {
+			mem = stream_arena_region(arena, 0, size);
+			if (!mem) {
+				stream_arena_destroy(arena);
+				return NULL;
+			}
+			stream_arena_link(dev, arena);
+		} else {
+			mem = stream_mem_plain(dev, size, align);
+		}
+	}
+
+	if (mem) {
+		mem->next = NULL;
+	}
+	return mem;
+}
+
+int stream_device_reserve(struct stream_device *dev, size_t size) {
+	struct stream_arena *arena;
+
+	arena = stream_arena_create(dev, size, 0);
+	if (!arena) {
+		return 1;
+	}
+	stream_arena_link(dev, arena);
+	return 0;
+}
+
+int stream_mem_put(struct stream_device *dev, struct stream_mem *mem) {
+	int err, c;
+
+	if (!mem) {
+		return 0;
+	}
+
+	// a region carved from a shared arena can't be unmapped on its own, it
+	// goes back to its size class
+	pthread_mutex_lock(&devices_lock);
+	if (mem->arena && !mem->arena->dedicated) {
+		c = stream_mem_class(mem->size);
+		mem->next = dev->carved[c];
+		dev->carved[c] = mem;
+		mem = NULL;
+	} else if (dev->no_free_mems < STREAM_MEM_CACHE) {
+		mem->next = dev->free_mems;
+		dev->free_mems = mem;
+		dev->no_free_mems++;
+		mem = NULL;
+	}
+
+	// the cache is full, this one goes
+	err = mem ? stream_mem_free(dev, mem) : 0;
+	pthread_mutex_unlock(&devices_lock);
+	return err;
+}
+
+int stream_parse_rails(const char *list, struct stream_rail *rails, int max) {
+	char *copy, *pair, *port, *save = NULL;
+	int n = 0;
+
+	copy = strdup(list);
+	if (!copy) {
+		return -1;
+	}
+
+	for (pair = strtok_r(copy, ",", &save); pair; pair = strtok_r(NULL, ",", &save)) {
+		if (n == max) {
+			fprintf(stderr, "More than %d rails\n", max);
+			n = -1;
+			break;
+		}
+
+		port = strchr(pair, ':');
+		if (port) {
+			*port++ = '\0';
+		}
+		rails[n].devname = strdup(pair);
+		rails[n].port = port ? strtol(port, NULL, 0) : 1;
+		if (!rails[n].devname || rails[n].port < 1) {
+			fprintf(stderr, "Bad rail %s\n", pair);
+			n = -1;
+			break;
+		}
+		++n;
+	}
+
+	free(copy);
+	return n;
+}
+
+int stream_port_rate(const struct ibv_port_attr *attr) {
+	int width, speed;
+
+	switch (attr->active_width) {
+	case 1:  width = 1;  break;
+	case 2:  width = 4;  break;
+	case 4:  width = 8;  break;
+	case 8:  width = 12; break;
+	case 16: width = 2;  break;
+	default: return 0;
+	}
+
+	// per lane, SDR through NDR
+	switch (attr->active_speed) {
+	case 1:   speed = 2500;   break;
+	case 2:   speed = 5000;   break;
+	case 4:
+	case 8:   speed = 10000;  break;
+	case 16:  speed = 14000;  break;
+	case 32:  speed = 25000;  break;
+	case 64:  speed = 50000;  break;
+	case 128: speed = 100000; break;
+	default: return 0;
+	}
+
+	return width * speed;
+}
@@ -0,0 +1,198 @@
+#ifndef IBV_DEVICE_H
+#define IBV_DEVICE_H
+
+#include <stddef.h>
+#include <infiniband/verbs.h>
+
+// no of registered regions kept around per device for reuse
+#define STREAM_MEM_CACHE 64
+// size classes of the regions carved from a reserved arena, powers of 2 up
+// to the largest mapping
+#define STREAM_MEM_CLASSES 48
+// smallest completion queue shared by the connections of a device
+#define STREAM_CQ_MIN_DEPTH 256
+// most shared completion queues on a device, one per poller
+#define STREAM_MAX_SHARDS 64
+// most device and port pairs a stream is spread over
+#define STREAM_MAX_RAILS 16
+// most NUMA nodes a memory policy can name
+#define STREAM_MAX_NODES 1024
+
+/**
+ * A mapping backed by hugepages, faulted in, locked and registered once.
+ * Regions are carved from an arena reserved up front, which saves the device
+ * translation entries and the registration of every region. Without one each
+ * region gets an arena sized to it.
+ */
+struct stream_arena {
+	void *base;
+	size_t size;
+	// bytes carved off so far
+	size_t used;
+	struct ibv_mr *mr;
+	// a single region of its own, unmapped when the region is freed
+	int dedicated;
+	struct stream_arena *next;
+};
+
+/**
+ * A registered memory region handed to a connection for its buffers. Regions
+ * go back to the device when the connection closes and are given to the next
+ * connection asking for the same size.
+ */
+struct stream_mem {
+	void *buf;
+	size_t size;
+	// the registration of the arena the region is part of
+	struct ibv_mr *mr;
+	// NULL for a region registered on its own
+	struct stream_arena *arena;
+	struct stream_mem *next;
+};
+
+struct stream_srq;
+
+/**
+ * A device and port pair traffic can go over
+ */
+struct stream_rail {
+	char *devname;
+	int port;
+};
+
+/**
+ * A completion queue shared by the connections of one poller
+ */
+struct stream_device_cq {
+	struct ibv_cq *cq;
+	struct ibv_comp_channel *channel;
+	// completions the connections on the queue may have outstanding
+	int reserved;
+};
+
+/**
+ * An opened device shared by all the connections on it. The context and the
+ * protection domain live as long as a connection holds a reference.
+ */
+struct stream_device {
+	// device list the device came from, kept until the device is closed
+	struct ibv_device **dev_list;
+	struct ibv_device *device;
+	struct ibv_context *context;
+	struct ibv_pd *pd;
+	// NUMA node the device is attached to, -1 if unknown
+	int numa_node;
+	// no of connections using the device
+	int ref;
+	// released regions waiting to be reused
+	struct stream_mem *free_mems;
+	int no_free_mems;
+	// released regions of the reserved arenas by size class, a region of
+	// class c is 2^c bytes and serves any request that rounds up to it
+	struct stream_mem *carved[STREAM_MEM_CLASSES];
+	// the reserved arenas ran out, said once
+	int reserve_full;
+	// arenas the regions come from, the newest first
+	struct stream_arena *arenas;
+	// receive queue shared by the connections in SRQ mode, created on first use
+	struct stream_srq *srq;
+	// completion queues shared by the connections, created on first use
+	struct stream_device_cq cqs[STREAM_MAX_SHARDS];
+	struct stream_device *next;
+};
+
+/**
+ * Get the named device. If name is NULL it is the first one on the NUMA node
+ * all the cores the process may run on belong to, or the first one available
+ * if they span nodes or none is on theirs. The device is
+ * opened on first use, later calls share it. Returns NULL on failure.
+ */
+struct stream_device *stream_device_get(const char *name);
+
+/**
+ * Drop a reference, the last one closes the device
+ */
+int stream_device_put(struct stream_device *dev);
+
+/**
+ * Get the shared receive queue of the device, creating it with size buffers of
+ * buf_size bytes on first use. Returns NULL on failure.
+ */
+struct stream_srq *stream_device_srq(struct stream_device *dev, uint32_t size,
+		uint32_t buf_size, uint32_t limit, size_t align);
+
+/**
+ * Get shared completion queue shard of the device and reserve room for cqe
+ * more completions, growing the queue if needed. The shards are spread over
+ * the completion vectors of the device. The queue gets a completion channel
+ * if use_event is set when it is created. Returns NULL on failure.
+ */
+struct ibv_cq *stream_device_cq(struct stream_device *dev, int shard, int cqe,
+		int use_event);
+
+/**
+ * Give back room reserved on shared completion queue shard
+ */
+void stream_device_cq_release(struct stream_device *dev, int shard, int cqe);
+
+/**
+ * Completion vector to use for the n-th queue, they wrap around once the
+ * device runs out
+ */
+int stream_device_comp_vector(struct stream_device *dev, int n);
+
+/**
+ * Parse a comma separated list of dev:port pairs into rails, the port is 1
+ * if left out. Returns the no of rails, -1 on failure.
+ */
+int stream_parse_rails(const char *list, struct stream_rail *rails, int max);
+
+/**
+ * Data rate of a port in Mbit/s from its active width and speed, 0 if the
+ * values are unknown
+ */
+int stream_port_rate(const struct ibv_port_attr *attr);
+
+/**
+ * Memory policy of a thread, put back by stream_device_unprefer
+ */
+struct stream_mempolicy {
+	int mode;
+	unsigned long mask[STREAM_MAX_NODES / (8 * sizeof (unsigned long))];
+	// whether the policy was changed and mode and mask hold the old one
+	int saved;
+};
+
+/**
+ * Have the memory the calling thread allocates from now on come from the node
+ * of the device, until stream_device_unprefer. The driver allocates the rings
+ * of the queues it creates on the calling thread. The policy of the thread is
+ * kept in old.
+ */
+void stream_device_prefer(struct stream_device *dev, struct stream_mempolicy *old);
+
+/**
+ * Give the calling thread back the policy stream_device_prefer kept in old
+ */
+void stream_device_unprefer(struct stream_device *dev, struct stream_mempolicy *old);
+
+/**
+ * Get a registered region of size bytes aligned to align, reusing a released
+ * one when possible. New regions are placed on the node of the device.
+ * Returns NULL on failure.
+ */
+struct stream_mem *stream_mem_get(struct stream_device *dev, size_t size, size_t align);
+
+/**
+ * Map, fault in, lock and register an arena of size bytes on the device up
+ * front, so the regions carved from it later cost nothing in the data path.
+ * Returns 1 on failure.
+ */
+int stream_device_reserve(struct stream_device *dev, size_t size);
+
+/**
+ * Give a region back to the device for reuse
+ */
+int stream_mem_put(struct stream_device *dev, struct stream_mem *mem);
+
+#endif /* IBV_DEVICE_H */
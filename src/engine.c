@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "engine.h"
+
+/**
+ * Read the cores of a NUMA node from sysfs, a list like 0-7,16-23. Returns 1
+ * if the node is unknown.
+ */
+static int stream_engine_node_cpus(int node, cpu_set_t *cpus) {
+	char path[64];
+	FILE *file;
+	int first, last, cpu, n;
+	char sep;
+
+	snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+	file = fopen(path, "r");
+	if (!file) {
+		return 1;
+	}
+
+	CPU_ZERO(cpus);
+	while ((n = fscanf(file, "%d%c", &first, &sep)) >= 1) {
+		last = first;
+		if (n == 2 && sep == '-' && fscanf(file, "%d%c", &last, &sep) < 1) {
+			break;
+		}
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+			CPU_SET(cpu, cpus);
+		}
+		if (n == 1 || sep != ',') {
+			break;
+		}
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/**
+ * The n-th core the process may run on, wrapping around, -1 if unknown. The
+ * cores on the node of the device are used if the process may run on any.
+ */
+static int stream_engine_cpu(struct stream_device *dev, int n) {
+	cpu_set_t cpus, local;
+	int cpu, count;
+
+	if (sched_getaffinity(0, sizeof cpus, &cpus) || !(count = CPU_COUNT(&cpus))) {
+		return -1;
+	}
+
+	// completions are read from memory on the node of the device
+	if (dev->numa_node >= 0 && !stream_engine_node_cpus(dev->numa_node, &local)) {
+		CPU_AND(&local, &local, &cpus);
+		if (CPU_COUNT(&local) > 0) {
+			cpus = local;
+			count = CPU_COUNT(&cpus);
+		}
+	}
+
+	n %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &cpus) && n-- == 0) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+struct stream_engine *stream_engine_create(struct stream_device *dev,
+		struct stream_connect_cfg *cfg, int first_poller, stream_close_handler closed,
+		void *closed_arg) {
+	struct stream_engine *engine;
+	int i, cpu;
+
+	if (cfg->shards < 1 || cfg->shards > STREAM_MAX_SHARDS) {
+		fprintf(stderr, "Shards must be between 1 and %d\n", STREAM_MAX_SHARDS);
+		return NULL;
+	}
+
+	engine = calloc(1, sizeof *engine);
+	if (!engine) {
+		fprintf(stderr, "Couldn't allocate engine\n");
+		return NULL;
+	}
+
+	engine->pollers = calloc(cfg->shards, sizeof (struct stream_poller *));
+	if (!engine->pollers) {
+		fprintf(stderr, "Couldn't allocate pollers\n");
+		free(engine);
+		return NULL;
+	}
+
+	for (i = 0; i < cfg->shards; ++i) {
+		// a lone poller is left to the scheduler unless the device has a
+		// node to keep it on
+		cpu = cfg->shards > 1 || first_poller > 0 || dev->numa_node >= 0 ?
+				stream_engine_cpu(dev, first_poller + i) : -1;
+		engine->pollers[i] = stream_poller_create(dev, cfg, i, cpu, closed, closed_arg);
+		if (!engine->pollers[i]) {
+			stream_engine_destroy(engine);
+			return NULL;
+		}
+		engine->no_pollers++;
+	}
+
+	return engine;
+}
+
+int stream_engine_destroy(struct stream_engine *engine) {
+	int i, err = 0;
+
+	if (!engine) {
+		return 0;
+	}
+
+	for (i = 0; i < engine->no_pollers; ++i) {
+		if (stream_poller_destroy(engine->pollers[i])) {
+			err = 1;
+		}
+	}
+
+	free(engine->pollers);
+	free(engine);
+	return err;
+}
+
+int stream_engine_pick(struct stream_engine *engine) {
+	int i, load, shard = 0, least = -1;
+
+	for (i = 0; i < engine->no_pollers; ++i) {
+		load = __atomic_load_n(&engine->pollers[i]->load, __ATOMIC_RELAXED);
+		if (least < 0 || load < least) {
+			least = load;
+			shard = i;
+		}
+	}
+	return shard;
+}
+
+int stream_engine_add(struct stream_engine *engine, struct stream_connect_ctx *ctx) {
+	if (!ctx->shared_cq || ctx->comp_vector < 0 || ctx->comp_vector >= engine->no_pollers) {
+		fprintf(stderr, "Connection isn't on a shard of the engine\n");
+		return 1;
+	}
+	return stream_poller_add(engine->pollers[ctx->comp_vector], ctx);
+}
+
+int stream_engine_remove(struct stream_engine *engine, struct stream_connect_ctx *ctx) {
+	return stream_poller_remove(engine->pollers[ctx->comp_vector], ctx);
+}
+
+struct stream_connect_ctx *stream_engine_find(struct stream_engine *engine, uint32_t id) {
+	// ids are handed out with the shard in the remainder
+	return stream_poller_find(engine->pollers[id % engine->no_pollers], id);
+}
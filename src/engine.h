@@ -0,0 +1,52 @@
+#ifndef IBV_ENGINE_H
+#define IBV_ENGINE_H
+
+#include "poller.h"
+
+/**
+ * A set of pollers on one device, each owning a shared completion queue on
+ * its own completion vector and, with more than one, pinned to its own core.
+ * Connections go to the poller with the fewest, so the work spreads over the
+ * cores instead of growing with the connections on one thread.
+ */
+struct stream_engine {
+	struct stream_poller **pollers;
+	int no_pollers;
+};
+
+/**
+ * Start cfg->shards pollers on the device. The pollers of the process are
+ * numbered across its engines, the first of this one is first_poller, so
+ * engines on the same node take different cores. Returns NULL on failure.
+ */
+struct stream_engine *stream_engine_create(struct stream_device *dev,
+		struct stream_connect_cfg *cfg, int first_poller, stream_close_handler closed,
+		void *closed_arg);
+
+/**
+ * Stop the pollers and close the connections left
+ */
+int stream_engine_destroy(struct stream_engine *engine);
+
+/**
+ * Shard a new connection should join, set as its comp_vector before it is
+ * created
+ */
+int stream_engine_pick(struct stream_engine *engine);
+
+/**
+ * Hand a connection to the poller of its shard. Returns 1 on failure.
+ */
+int stream_engine_add(struct stream_engine *engine, struct stream_connect_ctx *ctx);
+
+/**
+ * Take back a connection that never got going, see stream_poller_remove
+ */
+int stream_engine_remove(struct stream_engine *engine, struct stream_connect_ctx *ctx);
+
+/**
+ * Look up an open connection by id, NULL if it is gone
+ */
+struct stream_connect_ctx *stream_engine_find(struct stream_engine *engine, uint32_t id);
+
+#endif /* IBV_ENGINE_H */
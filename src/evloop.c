@@ -0,0 +1,237 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "stream_verbs.h"
+
+/**
+ * Take a connection that is done out of the loop and close it
+ */
+static void stream_evloop_close(struct stream_evloop *loop, struct stream_connect_ctx *ctx) {
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ctx->channel->fd, NULL);
+	stream_table_remove(&loop->conns, ctx->id);
+
+	if (loop->closed) {
+		loop->closed(ctx, loop->closed_arg);
+	}
+	stream_close_ctx(ctx);
+}
+
+/**
+ * Serve a connection whose channel has events
+ */
+static void stream_evloop_service(struct stream_evloop *loop, struct stream_connect_ctx *ctx) {
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	int ne;
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = ctx,
+	};
+
+	// the channel doesn't block, take every event pending on it
+	while (!ibv_get_cq_event(ctx->channel, &ev_cq, &ev_ctx)) {
+		stream_count_cq_event(ctx->cq, &ctx->num_cq_events);
+	}
+
+	if (ibv_req_notify_cq(ctx->cq, 0)) {
+		fprintf(stderr, "Couldn't request CQ notification\n");
+		ctx->state = STREAM_ERROR;
+	}
+
+	// completions that came in before the notify was armed raise no event,
+	// so the queue is polled until it is empty
+	while (ctx->state == STREAM_CONNECTED) {
+		ne = stream_progress(ctx);
+		if (ne < 0 || stream_dispatch(ctx)) {
+			if (ctx->state == STREAM_CONNECTED) {
+				ctx->state = STREAM_ERROR;
+			}
+			break;
+		}
+
+		if (ne == 0) {
+			break;
+		}
+	}
+
+	if (ctx->state != STREAM_CONNECTED) {
+		stream_evloop_close(loop, ctx);
+		return;
+	}
+
+	// one shot, no other thread can pick the connection up until now
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ctx->channel->fd, &ev)) {
+		perror("epoll_ctl");
+		ctx->state = STREAM_ERROR;
+		stream_evloop_close(loop, ctx);
+	}
+}
+
+static void stream_evloop_run(void *item, void *arg) {
+	stream_evloop_service(arg, item);
+}
+
+/**
+ * Queue the connections with events on the worker
+ */
+static void stream_evloop_feed(struct stream_pool *pool, int worker, void *arg) {
+	struct stream_evloop *loop = arg;
+	struct epoll_event events[STREAM_EPOLL_BATCH];
+	uint64_t count = 1;
+	int n, i, queued = 0;
+
+	// wakes up now and then to see a stop request
+	n = epoll_wait(loop->epfd, events, STREAM_EPOLL_BATCH, STREAM_ASYNC_POLL_MS);
+	for (i = 0; i < n; ++i) {
+		// woken by a busy peer, back to the pool to steal from it
+		if (!events[i].data.ptr) {
+			if (read(loop->wakefd, &count, sizeof count) < 0) {
+				count = 0;
+			}
+			continue;
+		}
+
+		if (stream_pool_push(pool, worker, events[i].data.ptr)) {
+			stream_evloop_service(loop, events[i].data.ptr);
+		} else {
+			queued++;
+		}
+	}
+
+	// the others sleep in epoll_wait and wouldn't see the burst until
+	// their timeout
+	if (queued > 1 && write(loop->wakefd, &count, sizeof count) < 0) {
+		perror("write");
+	}
+}
+
+struct stream_evloop *stream_evloop_create(int no_threads,
+		stream_close_handler closed, void *closed_arg) {
+	struct stream_evloop *loop;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+
+	loop = calloc(1, sizeof *loop);
+	if (!loop) {
+		fprintf(stderr, "Couldn't allocate event loop\n");
+		return NULL;
+	}
+	loop->closed = closed;
+	loop->closed_arg = closed_arg;
+	loop->epfd = -1;
+	loop->wakefd = -1;
+
+	if (stream_table_init(&loop->conns, STREAM_TABLE_INIT_SIZE)) {
+		goto error;
+	}
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("epoll_create1");
+		goto error;
+	}
+
+	loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakefd < 0) {
+		perror("eventfd");
+		goto error;
+	}
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev)) {
+		perror("epoll_ctl");
+		goto error;
+	}
+
+	loop->pool = stream_pool_create(no_threads, stream_evloop_run,
+			stream_evloop_feed, loop);
+	if (!loop->pool) {
+		goto error;
+	}
+
+	return loop;
+
+	error:
+	if (loop->wakefd >= 0) {
+		close(loop->wakefd);
+	}
+	if (loop->epfd >= 0) {
+		close(loop->epfd);
+	}
+	if (loop->conns.slots) {
+		stream_table_free(&loop->conns);
+	}
+	free(loop);
+	return NULL;
+}
+
+int stream_evloop_destroy(struct stream_evloop *loop) {
+	struct stream_connect_ctx *ctx;
+	uint32_t pos = 0;
+
+	if (!loop) {
+		return 0;
+	}
+
+	// connections left queued are still in the table
+	stream_pool_destroy(loop->pool);
+
+	// connections still open are cut off
+	while ((ctx = stream_table_next(&loop->conns, &pos))) {
+		if (loop->closed) {
+			loop->closed(ctx, loop->closed_arg);
+		}
+		stream_close_ctx(ctx);
+	}
+
+	close(loop->wakefd);
+	close(loop->epfd);
+	stream_table_free(&loop->conns);
+	free(loop);
+	return 0;
+}
+
+int stream_evloop_add(struct stream_evloop *loop, struct stream_connect_ctx *ctx) {
+	int flags;
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = ctx,
+	};
+
+	if (!ctx->channel) {
+		fprintf(stderr, "Connection has no completion channel\n");
+		return 1;
+	}
+
+	// events are drained until the channel runs dry
+	flags = fcntl(ctx->channel->fd, F_GETFL);
+	if (fcntl(ctx->channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		fprintf(stderr, "Couldn't make CQ events non blocking\n");
+		return 1;
+	}
+
+	ctx->id = __atomic_fetch_add(&loop->next_id, 1, __ATOMIC_RELAXED);
+	if (stream_table_insert(&loop->conns, ctx->id, ctx)) {
+		fprintf(stderr, "Couldn't add connection %u\n", ctx->id);
+		return 1;
+	}
+
+	// an event that came in before this is still reported
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ctx->channel->fd, &ev)) {
+		perror("epoll_ctl");
+		stream_table_remove(&loop->conns, ctx->id);
+		return 1;
+	}
+
+	return 0;
+}
+
+int stream_evloop_remove(struct stream_evloop *loop, struct stream_connect_ctx *ctx) {
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ctx->channel->fd, NULL);
+	return stream_table_remove(&loop->conns, ctx->id) ? 0 : 1;
+}
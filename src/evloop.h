@@ -0,0 +1,55 @@
+#ifndef IBV_EVLOOP_H
+#define IBV_EVLOOP_H
+
+#include "pool.h"
+#include "stream.h"
+#include "table.h"
+
+// no of ready channels taken from epoll at a time
+#define STREAM_EPOLL_BATCH 64
+
+/**
+ * A pool of workers sleeping in epoll on the completion channels of many
+ * connections, each with its own CQ. A worker queues the connections it is
+ * woken for, and idle workers steal from its queue. A connection is served by
+ * one worker at a time, its channel is armed again once the worker is done
+ * with it.
+ */
+struct stream_evloop {
+	int epfd;
+	// in the epoll set, written when a worker queued more than it can serve
+	// at once so a sleeping one gets up to steal
+	int wakefd;
+	struct stream_pool *pool;
+	// connections by id, to close the ones left at the end
+	struct stream_table conns;
+	uint32_t next_id;
+	// told about every connection that ends
+	stream_close_handler closed;
+	void *closed_arg;
+};
+
+/**
+ * Start an event loop with no_threads workers. Returns NULL on failure.
+ */
+struct stream_evloop *stream_evloop_create(int no_threads,
+		stream_close_handler closed, void *closed_arg);
+
+/**
+ * Stop the threads, close the connections left and free the loop
+ */
+int stream_evloop_destroy(struct stream_evloop *loop);
+
+/**
+ * Hand a connection with its own completion channel to the loop, which closes
+ * it when it is done. Returns 1 on failure.
+ */
+int stream_evloop_add(struct stream_evloop *loop, struct stream_connect_ctx *ctx);
+
+/**
+ * Take back a connection that never got going, the caller closes it. Only
+ * safe while the peer can't have sent anything yet.
+ */
+int stream_evloop_remove(struct stream_evloop *loop, struct stream_connect_ctx *ctx);
+
+#endif /* IBV_EVLOOP_H */
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+#define STREAM_HANDOFF_MASK (STREAM_HANDOFF_RING_SIZE - 1)
+
+static int stream_spsc_push(struct stream_spsc *ring, struct stream_handoff_msg *item) {
+	uint32_t tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == STREAM_HANDOFF_RING_SIZE) {
+		return 1;
+	}
+
+	ring->items[tail & STREAM_HANDOFF_MASK] = *item;
+	// the item is written before the consumer can see it
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int stream_spsc_pop(struct stream_spsc *ring, struct stream_handoff_msg *item) {
+	uint32_t head = ring->head;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	*item = ring->items[head & STREAM_HANDOFF_MASK];
+	// the item is copied out before the producer can reuse the slot
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void *stream_handoff_thread(void *arg) {
+	struct stream_handler_thread *thread = arg;
+	struct stream_handoff *handoff = thread->handoff;
+	struct stream_handoff_msg item;
+	struct stream_connect_ctx *ctx;
+	int idle = 0;
+
+	while (!handoff->stop) {
+		if (!stream_spsc_pop(&thread->in, &item)) {
+			if (++idle >= STREAM_HANDOFF_SPIN) {
+				usleep(STREAM_HANDOFF_NAP_US);
+				idle = 0;
+			}
+			continue;
+		}
+		idle = 0;
+
+		ctx = item.ctx;
+		item.failed = item.msg.type == STREAM_MESSAGE_DATA && ctx->handler &&
+				ctx->handler(ctx, &item.msg, ctx->handler_arg);
+
+		// the poller drains the returns between polls
+		while (stream_spsc_push(&thread->out, &item) && !handoff->stop) {
+			usleep(STREAM_HANDOFF_NAP_US);
+		}
+	}
+
+	return NULL;
+}
+
+struct stream_handoff *stream_handoff_create(int no_threads, uint32_t id_stride) {
+	struct stream_handoff *handoff;
+	int i;
+
+	handoff = calloc(1, sizeof *handoff);
+	if (!handoff) {
+		fprintf(stderr, "Couldn't allocate handler threads\n");
+		return NULL;
+	}
+	handoff->id_stride = id_stride;
+
+	if (posix_memalign((void **) &handoff->threads, 64,
+			no_threads * sizeof (struct stream_handler_thread))) {
+		fprintf(stderr, "Couldn't allocate handler rings\n");
+		free(handoff);
+		return NULL;
+	}
+
+	for (i = 0; i < no_threads; ++i) {
+		handoff->threads[i].handoff = handoff;
+		handoff->threads[i].in.head = handoff->threads[i].in.tail = 0;
+		handoff->threads[i].out.head = handoff->threads[i].out.tail = 0;
+	}
+
+	for (i = 0; i < no_threads; ++i) {
+		if (pthread_create(&handoff->threads[i].thread, NULL, stream_handoff_thread,
+				&handoff->threads[i])) {
+			fprintf(stderr, "Couldn't start handler thread\n");
+			handoff->no_threads = i;
+			stream_handoff_destroy(handoff);
+			return NULL;
+		}
+	}
+	handoff->no_threads = no_threads;
+
+	return handoff;
+}
+
+int stream_handoff_destroy(struct stream_handoff *handoff) {
+	int i;
+
+	if (!handoff) {
+		return 0;
+	}
+
+	handoff->stop = 1;
+	for (i = 0; i < handoff->no_threads; ++i) {
+		pthread_join(handoff->threads[i].thread, NULL);
+	}
+
+	free(handoff->threads);
+	free(handoff);
+	return 0;
+}
+
+int stream_handoff_push(struct stream_handoff *handoff, struct stream_connect_ctx *ctx,
+		struct stream_message *msg, uint32_t index) {
+	struct stream_handoff_msg item = {
+		.ctx = ctx,
+		.index = index,
+		.msg = *msg,
+	};
+
+	// the ids of one poller all leave the same rest over the shards, count
+	// the connections of the poller instead
+	return stream_spsc_push(&handoff->threads[(ctx->id / handoff->id_stride) %
+			handoff->no_threads].in, &item);
+}
+
+int stream_handoff_pop(struct stream_handoff *handoff, int i, struct stream_handoff_msg *done) {
+	return stream_spsc_pop(&handoff->threads[i].out, done);
+}
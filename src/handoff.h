@@ -0,0 +1,89 @@
+#ifndef IBV_HANDOFF_H
+#define IBV_HANDOFF_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "stream.h"
+
+// messages in flight to a handler thread, a power of 2
+#define STREAM_HANDOFF_RING_SIZE 1024
+// empty polls of a handler thread before it naps, and the nap in us
+#define STREAM_HANDOFF_SPIN 1024
+#define STREAM_HANDOFF_NAP_US 50
+
+/**
+ * A received message on its way to a handler and back
+ */
+struct stream_handoff_msg {
+	struct stream_connect_ctx *ctx;
+	// slot of the message in the receive ring of the connection
+	uint32_t index;
+	struct stream_message msg;
+	// the handler failed, only the poller touches the connection state
+	int failed;
+};
+
+/**
+ * A lock-free ring with one producer and one consumer. The two ends live on
+ * their own cache lines so they don't bounce between the threads.
+ */
+struct stream_spsc {
+	// next to take, written by the consumer
+	uint32_t head __attribute__((aligned(64)));
+	// next to fill, written by the producer
+	uint32_t tail __attribute__((aligned(64)));
+	struct stream_handoff_msg items[STREAM_HANDOFF_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct stream_handoff;
+
+/**
+ * A handler thread with a ring of messages from the poller and a ring of
+ * messages going back once they are handled
+ */
+struct stream_handler_thread {
+	struct stream_handoff *handoff;
+	pthread_t thread;
+	struct stream_spsc in;
+	struct stream_spsc out;
+};
+
+/**
+ * Threads running the message handlers of the connections of one poller, so
+ * a slow handler doesn't hold up the completion queue. The messages of a
+ * connection all go to the same thread and come back in order.
+ */
+struct stream_handoff {
+	struct stream_handler_thread *threads;
+	int no_threads;
+	// ids of the connections step by this on the poller, see stream_poller
+	uint32_t id_stride;
+	volatile int stop;
+};
+
+/**
+ * Start no_threads handler threads for a poller giving out ids id_stride
+ * apart. Returns NULL on failure.
+ */
+struct stream_handoff *stream_handoff_create(int no_threads, uint32_t id_stride);
+
+/**
+ * Stop the threads, messages in flight are dropped with their connections
+ */
+int stream_handoff_destroy(struct stream_handoff *handoff);
+
+/**
+ * Pass a taken message to the handler thread of its connection, only from
+ * the poller. Returns 1 if the thread is full.
+ */
+int stream_handoff_push(struct stream_handoff *handoff, struct stream_connect_ctx *ctx,
+		struct stream_message *msg, uint32_t index);
+
+/**
+ * Take the next handled message back from thread i, only from the poller.
+ * Returns 1 if there was one.
+ */
+int stream_handoff_pop(struct stream_handoff *handoff, int i, struct stream_handoff_msg *done);
+
+#endif /* IBV_HANDOFF_H */
@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "lanes.h"
+#include "stream_verbs.h"
+
+// streams connected by the process so far
+static uint32_t stream_lanes_next;
+
+struct stream_lanes *stream_lanes_connect(struct stream_connect_cfg *cfg,
+		struct stream_rail *rails, int no_rails, int no_lanes, int merge) {
+	struct stream_connect_cfg lane_cfg = *cfg;
+	struct stream_lanes *lanes;
+	int i;
+
+	if (no_lanes < 1 || no_lanes > STREAM_MAX_LANES) {
+		fprintf(stderr, "Lanes must be between 1 and %d\n", STREAM_MAX_LANES);
+		return NULL;
+	}
+
+	lanes = calloc(1, sizeof *lanes);
+	if (!lanes) {
+		fprintf(stderr, "Couldn't allocate lanes\n");
+		return NULL;
+	}
+	// the server tells the streams of its clients apart by the id, the host
+	// and process keep clients started at the same time apart and the count
+	// the streams of one client
+	lanes->id = ((uint32_t) gethostid() * 2654435761U) ^ ((uint32_t) getpid() << 16) ^
+			__atomic_fetch_add(&stream_lanes_next, 1, __ATOMIC_RELAXED);
+	lanes->merge = merge;
+	lanes->ref = 1;
+
+	lane_cfg.connect_id = lanes->id;
+	lane_cfg.no_lanes = no_lanes;
+	lane_cfg.merge = merge;
+	for (i = 0; i < no_lanes; ++i) {
+		lane_cfg.lane = i;
+		if (no_rails > 0) {
+			lane_cfg.rail = i % no_rails;
+			lane_cfg.ib_devname = rails[lane_cfg.rail].devname;
+			lane_cfg.ib_port = rails[lane_cfg.rail].port;
+		}
+		lanes->lanes[i] = stream_connect(&lane_cfg);
+		if (!lanes->lanes[i]) {
+			stream_lanes_close(lanes);
+			return NULL;
+		}
+		lanes->no_lanes++;
+
+		// a port of unknown rate counts as 1 Gbit/s
+		lanes->weight[i] = MAX(1, stream_port_rate(&lanes->lanes[i]->portinfo) / 1000);
+		lanes->total_weight += lanes->weight[i];
+
+		if (merge) {
+			lanes->lanes[i]->shared_sequence = &lanes->sequence;
+		}
+	}
+
+	return lanes;
+}
+
+int stream_lanes_close(struct stream_lanes *lanes) {
+	int i, err = 0;
+
+	for (i = 0; i < lanes->no_lanes; ++i) {
+		if (stream_close_ctx(lanes->lanes[i])) {
+			err = 1;
+		}
+	}
+
+	free(lanes);
+	return err;
+}
+
+/**
+ * The lane to send the next segment on. Smooth weighted round robin over the
+ * lanes with room, so each gets its share evenly spread out and a full one
+ * is passed over until it drains.
+ */
+static struct stream_connect_ctx *stream_lanes_pick(struct stream_lanes *lanes) {
+	int i, best = -1, total = 0;
+
+	for (i = 0; i < lanes->no_lanes; ++i) {
+		if (stream_send_window(lanes->lanes[i]) <= 0) {
+			continue;
+		}
+
+		lanes->current[i] += lanes->weight[i];
+		total += lanes->weight[i];
+		if (best < 0 || lanes->current[i] > lanes->current[best]) {
+			best = i;
+		}
+	}
+
+	if (best < 0) {
+		return NULL;
+	}
+	lanes->current[best] -= total;
+	return lanes->lanes[best];
+}
+
+int stream_lanes_send(struct stream_lanes *lanes, const uint8_t *buf, uint64_t len) {
+	struct stream_connect_ctx *ctx;
+	uint64_t segment = lanes->lanes[0]->size - STREAM_MESSAGE_OVERHEAD;
+	uint64_t parts = len ? (len + segment - 1) / segment : 1;
+	uint64_t n;
+
+	if (!lanes->merge) {
+		fprintf(stderr, "Only a merged stream can be striped\n");
+		return 1;
+	}
+	if (parts > STREAM_MAX_PARTS) {
+		fprintf(stderr, "Message of %lu bytes has more than %d segments\n",
+				(unsigned long) len, STREAM_MAX_PARTS);
+		return 1;
+	}
+
+	do {
+		ctx = stream_lanes_pick(lanes);
+		if (!ctx) {
+			return EAGAIN;
+		}
+
+		n = MIN(segment, len - lanes->offset);
+		// the last segment goes out with part 0
+		if (stream_send_part(ctx, buf + lanes->offset, n,
+				parts - 1 - lanes->offset / segment)) {
+			return 1;
+		}
+		lanes->offset += n;
+	} while (lanes->offset < len);
+
+	lanes->offset = 0;
+	return 0;
+}
+
+struct stream_lanes *stream_lanes_create(uint32_t id, int no_lanes, int merge,
+		struct stream_device *dev, int shard, uint64_t window) {
+	struct stream_lanes *lanes;
+
+	if (no_lanes < 1 || no_lanes > STREAM_MAX_LANES) {
+		fprintf(stderr, "Lanes must be between 1 and %d\n", STREAM_MAX_LANES);
+		return NULL;
+	}
+
+	lanes = calloc(1, sizeof *lanes);
+	if (!lanes) {
+		fprintf(stderr, "Couldn't allocate lanes\n");
+		return NULL;
+	}
+	lanes->id = id;
+	lanes->no_lanes = no_lanes;
+	lanes->merge = merge;
+	lanes->dev = dev;
+	lanes->shard = shard;
+	lanes->ref = 1;
+
+	if (merge) {
+		lanes->window = 64;
+		while (lanes->window < window) {
+			lanes->window <<= 1;
+		}
+
+		lanes->arrived = calloc(lanes->window / 64, sizeof (uint64_t));
+		lanes->arrived_lane = calloc(lanes->window, sizeof (uint8_t));
+		if (!lanes->arrived || !lanes->arrived_lane) {
+			fprintf(stderr, "Couldn't allocate reorder window of %lu\n",
+					(unsigned long) lanes->window);
+			stream_lanes_put(lanes);
+			return NULL;
+		}
+	}
+
+	return lanes;
+}
+
+int stream_lanes_join(struct stream_lanes *lanes, struct stream_connect_ctx *ctx) {
+	if (ctx->lane < 0 || ctx->lane >= lanes->no_lanes || lanes->lanes[ctx->lane]) {
+		fprintf(stderr, "Bad lane %d of stream %u\n", ctx->lane, lanes->id);
+		return 1;
+	}
+
+	stream_lanes_get(lanes);
+	ctx->lanes = lanes;
+	// the driving thread may be going over the lanes already
+	__atomic_store_n(&lanes->lanes[ctx->lane], ctx, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&lanes->joined, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void stream_lanes_leave(struct stream_lanes *lanes, struct stream_connect_ctx *ctx) {
+	if (__atomic_load_n(&lanes->joined, __ATOMIC_ACQUIRE) < lanes->no_lanes) {
+		__atomic_store_n(&lanes->abandoned, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&lanes->lanes[ctx->lane], NULL, __ATOMIC_RELEASE);
+	ctx->lanes = NULL;
+	stream_lanes_put(lanes);
+}
+
+void stream_lanes_get(struct stream_lanes *lanes) {
+	__atomic_add_fetch(&lanes->ref, 1, __ATOMIC_RELAXED);
+}
+
+void stream_lanes_put(struct stream_lanes *lanes) {
+	if (__atomic_sub_fetch(&lanes->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(lanes->arrived);
+		free(lanes->arrived_lane);
+		free(lanes);
+	}
+}
+
+int stream_lanes_arrived(struct stream_lanes *lanes, int lane, uint64_t sequence) {
+	uint64_t slot;
+
+	// the peer can't have more in flight than the lanes have credit
+	if (sequence - lanes->sequence >= lanes->window) {
+		fprintf(stderr, "Message %lu of stream %u is outside the reorder window\n",
+				(unsigned long) sequence, lanes->id);
+		return 1;
+	}
+
+	slot = sequence & (lanes->window - 1);
+	lanes->arrived[slot / 64] |= 1ULL << (slot % 64);
+	lanes->arrived_lane[slot] = lane;
+	return 0;
+}
+
+void stream_lanes_dispatch(struct stream_lanes *lanes) {
+	struct stream_connect_ctx *ctx;
+	uint64_t slot, word, mask;
+	int i, run, bit;
+
+	// take the run of arrived messages from the next one on, a word of the
+	// bitmap at a time. Each lane receives its messages in order, so the
+	// next one is always the oldest message of the lane it came in on.
+	while (1) {
+		slot = lanes->sequence & (lanes->window - 1);
+		bit = slot % 64;
+		word = lanes->arrived[slot / 64] >> bit;
+		run = ~word ? __builtin_ctzll(~word) : 64;
+		if (run == 0) {
+			break;
+		}
+
+		for (i = 0; i < run; ++i) {
+			ctx = __atomic_load_n(&lanes->lanes[lanes->arrived_lane[slot + i]],
+					__ATOMIC_ACQUIRE);
+			if (!ctx || ctx->state != STREAM_CONNECTED || stream_deliver_next(ctx)) {
+				run = i;
+				break;
+			}
+		}
+
+		mask = run == 64 ? ~0ULL : ((1ULL << run) - 1) << bit;
+		lanes->arrived[slot / 64] &= ~mask;
+		lanes->sequence += run;
+		if (run < 64 - bit) {
+			break;
+		}
+	}
+
+	// post the receives that were given back and take the control messages
+	for (i = 0; i < lanes->no_lanes; ++i) {
+		ctx = __atomic_load_n(&lanes->lanes[i], __ATOMIC_ACQUIRE);
+		if (ctx && ctx->state == STREAM_CONNECTED && stream_dispatch(ctx) &&
+				ctx->state == STREAM_CONNECTED) {
+			ctx->state = STREAM_ERROR;
+		}
+	}
+}
@@ -0,0 +1,115 @@
+#ifndef IBV_LANES_H
+#define IBV_LANES_H
+
+#include "device.h"
+#include "stream.h"
+
+// most connections a stream is spread over
+#define STREAM_MAX_LANES 64
+
+// most segments a striped message is split into, part is 16 bits
+#define STREAM_MAX_PARTS (UINT16_MAX + 1)
+
+/**
+ * A logical stream spread over several connections to the same peer, so each
+ * sending thread posts to its own queue pair without sharing anything. The
+ * receiver sees every lane in its own order. If the lanes are merged the
+ * senders draw their sequence numbers from one counter, and the receiver
+ * delivers the messages of all the lanes in that order.
+ */
+struct stream_lanes {
+	uint32_t id;
+	struct stream_connect_ctx *lanes[STREAM_MAX_LANES];
+	int no_lanes;
+	int merge;
+	// next sequence to hand out when sending, or to deliver when receiving
+	uint64_t sequence;
+	// lanes joined so far on the receiving side
+	int joined;
+	// a lane left before all of them joined, the stream can't be completed
+	int abandoned;
+	// references held by the lanes and whoever groups them
+	int ref;
+	// shard the receiver put the lanes on, they are all driven by one thread
+	struct stream_device *dev;
+	int shard;
+	// last poll round of that thread that had completions for the lanes
+	uint64_t poll_round;
+	// reorder window of a merged stream, a bit for every message that arrived
+	// and isn't delivered yet, and the lane it came in on. A power of 2 at
+	// least as large as the credit of all the lanes together.
+	uint64_t *arrived;
+	uint8_t *arrived_lane;
+	uint64_t window;
+	// sending side of a striped stream, the part of the current message
+	// posted so far
+	uint64_t offset;
+	// share of the traffic of each lane, from the rate of its port, and
+	// where the weighted round robin over them stands
+	int weight[STREAM_MAX_LANES];
+	int current[STREAM_MAX_LANES];
+	int total_weight;
+};
+
+/**
+ * Connect no_lanes lanes of a new stream to cfg->servername. With rails the
+ * lanes take turns over them, lane i going over rail i % no_rails, otherwise
+ * they all use the device of cfg. Lane i is for the use of one thread only.
+ * Returns NULL on failure.
+ */
+struct stream_lanes *stream_lanes_connect(struct stream_connect_cfg *cfg,
+		struct stream_rail *rails, int no_rails, int no_lanes, int merge);
+
+/**
+ * Close every lane and free the stream
+ */
+int stream_lanes_close(struct stream_lanes *lanes);
+
+/**
+ * Send a message striped over the lanes of a merged stream from a single
+ * thread. The message is cut into segments of a buffer each, spread over the
+ * lanes with room in proportion to their weight. Returns 0 once all of it is posted,
+ * EAGAIN when the lanes are full, in which case the call is repeated with the
+ * same message after progress, 1 on error.
+ */
+int stream_lanes_send(struct stream_lanes *lanes, const uint8_t *buf, uint64_t len);
+
+/**
+ * Receiving side, a stream to group the lanes of id into as they come in,
+ * driven on shard of dev. A merged stream keeps a reorder window of at least window messages. The
+ * caller holds a reference. Returns NULL on failure.
+ */
+struct stream_lanes *stream_lanes_create(uint32_t id, int no_lanes, int merge,
+		struct stream_device *dev, int shard, uint64_t window);
+
+/**
+ * Add a received lane, which takes a reference until it leaves
+ */
+int stream_lanes_join(struct stream_lanes *lanes, struct stream_connect_ctx *ctx);
+
+/**
+ * A lane is closing, take it out and drop its reference. A lane leaving
+ * before the rest joined marks the stream abandoned.
+ */
+void stream_lanes_leave(struct stream_lanes *lanes, struct stream_connect_ctx *ctx);
+
+void stream_lanes_get(struct stream_lanes *lanes);
+
+/**
+ * Drop a reference, the last one frees the stream
+ */
+void stream_lanes_put(struct stream_lanes *lanes);
+
+/**
+ * A message with sequence came in on lane of a merged stream. Returns 1 if it
+ * falls outside the reorder window.
+ */
+int stream_lanes_arrived(struct stream_lanes *lanes, int lane, uint64_t sequence);
+
+/**
+ * Deliver the messages of all the lanes in sequence order, as far as the
+ * lanes have them. Only from the thread driving the lanes.
+ */
+void stream_lanes_dispatch(struct stream_lanes *lanes);
+
+#endif /* IBV_LANES_H */
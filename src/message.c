@@ -1,29 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "message.h"
 
-int stream_data_message_copy_to_buffer(struct stream_message *msg, uint8_t *buf) {
+int stream_data_message_header_to_buffer(struct stream_message *msg, uint8_t *buf) {
+	unsigned int address = 0;
+	memcpy(buf + address, &msg->head, sizeof (uint8_t));
+	address += sizeof (uint8_t);
+	memcpy(buf + address, &msg->type, sizeof (uint8_t));
+	address += sizeof (uint8_t);
+	memcpy(buf + address, &msg->sequence, sizeof (uint64_t));
+	address += sizeof (uint64_t);
+	memcpy(buf + address, &msg->part, sizeof (uint16_t));
+	address += sizeof (uint16_t);
+	memcpy(buf + address, &msg->credit, sizeof (uint16_t));
+	address += sizeof (uint16_t);
+	memcpy(buf + address, &msg->length, sizeof (uint64_t));
+	address += sizeof (uint64_t);
+	return address;
+}
+
+int stream_data_message_header_from_buffer(uint8_t *buf, struct stream_message *msg) {
 	unsigned int address = 0;
-	memcpy(buf + address, (uint8_t *)&msg->head, sizeof uint8_t);
-	address += sizeof uint8_t;
-	memcpy(buf + address, (uint64_t *)&msg->sequence, sizeof uint64_t);
-	address += sizeof uint64_t;
-	memcpy(buf + address, (uint16_t *)&msg->part, sizeof uint16_t);
-	address += sizeof uint16_t;
-	memcpy(buf + address, (uint16_t *)&msg->credit, sizeof uint16_t);
-	address += sizeof uint16_t;
-	memcpy(buf + address, (uint64_t *)&msg->length, sizeof uint64_t);
-	address += sizeof uint64_t;
-	memcpy(buf + address, (uint8_t *)msg->buf, msg->length);
+	memcpy(&msg->head, buf + address, sizeof (uint8_t));
+	address += sizeof (uint8_t);
+	memcpy(&msg->type, buf + address, sizeof (uint8_t));
+	address += sizeof (uint8_t);
+	memcpy(&msg->sequence, buf + address, sizeof (uint64_t));
+	address += sizeof (uint64_t);
+	memcpy(&msg->part, buf + address, sizeof (uint16_t));
+	address += sizeof (uint16_t);
+	memcpy(&msg->credit, buf + address, sizeof (uint16_t));
+	address += sizeof (uint16_t);
+	memcpy(&msg->length, buf + address, sizeof (uint64_t));
+	address += sizeof (uint64_t);
+	// the data stays in place, right after the header
+	msg->buf = buf + address;
+	return address;
+}
+
+int stream_data_message_copy_to_buffer(struct stream_message *msg, uint8_t *buf) {
+	unsigned int address = stream_data_message_header_to_buffer(msg, buf);
+	memcpy(buf + address, msg->buf, msg->length);
 	address += msg->length;
-	memcpy(buf + address, (uint8_t *)&msg->tail, msg->tail);
+	memcpy(buf + address, &msg->tail, sizeof (uint8_t));
+	address += sizeof (uint8_t);
+	return address;
 }
 
 int stream_connect_message_copy_to_buffer(struct stream_connect_message *msg, uint8_t *buf) {
-	memcpy(buf, (uint8_t *)msg, sizeof (struct stream_connet_message));
+	memcpy(buf, (uint8_t *)msg, sizeof (struct stream_connect_message));
+	return sizeof (struct stream_connect_message);
 }
 
-struct stream_connect_message *stream_connect_message_copy_to_buffer(uint8_t *buf) {
+struct stream_connect_message *stream_connect_message_copy_from_buffer(uint8_t *buf) {
 	struct stream_connect_message *msg = NULL;
 	msg = (struct stream_connect_message *)malloc(sizeof(struct stream_connect_message));
+	if (!msg) {
+		return NULL;
+	}
 	memcpy(msg, (struct stream_connect_message *)buf, sizeof(struct stream_connect_message));
 	return msg;
 }
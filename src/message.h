@@ -2,6 +2,7 @@
 #define IBV_MESSAGE_H
 
 #include <stdint.h>
+#include <infiniband/verbs.h>
 
 /**
  * An RDMA destination. This information is needed to connect a Queue Pair.
@@ -13,12 +14,37 @@ struct stream_dest {
 	union ibv_gid gid;
 };
 
+/**
+ * Kind of message carried in a buffer
+ */
+enum {
+	// application data, may carry returned credit
+	STREAM_MESSAGE_DATA = 1,
+	// standalone credit update with no data
+	STREAM_MESSAGE_CREDIT = 2,
+	// the sender is done, no more messages follow
+	STREAM_MESSAGE_CLOSE = 3,
+};
+
+/**
+ * Size of the message header on the wire: head, type, sequence, part, credit, length
+ */
+#define STREAM_MESSAGE_HEADER_SIZE (2 * sizeof (uint8_t) + sizeof (uint64_t) + \
+		2 * sizeof (uint16_t) + sizeof (uint64_t))
+
+/**
+ * Header and tail around the data of a message on the wire
+ */
+#define STREAM_MESSAGE_OVERHEAD (STREAM_MESSAGE_HEADER_SIZE + sizeof (uint8_t))
+
 /**
  * Actual message
  */
 struct stream_message {
 	// flag to indicate head
 	uint8_t head;
+	// kind of message
+	uint8_t type;
 	// sequence no
 	uint64_t sequence;
 	// part no in case of multiple segments
@@ -43,10 +69,19 @@ struct stream_connect_message {
 	// an identifier to identify the connection.
 	// this should be used when sending messages
 	uint64_t connect_id;
+	// lane of a stream spread over several connections, and their number
+	uint8_t lane;
+	uint8_t no_lanes;
+	// the lanes carry one sequence to be merged back into a single order
+	uint8_t merge;
+	// device and port pair of the receiver the lane goes over
+	uint8_t rail;
 };
 
 int stream_data_message_copy_to_buffer(struct stream_message *msg, uint8_t *buf);
+int stream_data_message_header_to_buffer(struct stream_message *msg, uint8_t *buf);
+int stream_data_message_header_from_buffer(uint8_t *buf, struct stream_message *msg);
 int stream_connect_message_copy_to_buffer(struct stream_connect_message *msg, uint8_t *buf);
-struct stream_connect_message *stream_connect_message_copy_to_buffer(uint8_t *buf);
+struct stream_connect_message *stream_connect_message_copy_from_buffer(uint8_t *buf);
 
-#endif /* IBV_BUFFER_H */
+#endif /* IBV_MESSAGE_H */
@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lanes.h"
+#include "poller.h"
+#include "stream_verbs.h"
+
+/**
+ * A completion for a connection that is already closed. Only a shared
+ * receive needs anything, its buffer goes back to the pool.
+ */
+static void stream_poller_stale(struct stream_poller *poller, struct ibv_wc *wc) {
+	if (STREAM_WRID_TYPE(wc->wr_id) == STREAM_SRQ_WRID && poller->dev->srq) {
+		stream_srq_release(poller->dev->srq, stream_srq_received(poller->dev->srq,
+				STREAM_WRID_INDEX(wc->wr_id)));
+	}
+}
+
+/**
+ * Remove a drained connection and close it
+ */
+static void stream_poller_close(struct stream_poller *poller, struct stream_connect_ctx *ctx) {
+	struct stream_connect_ctx **prev;
+
+	stream_table_remove(&poller->table, ctx->qp->qp_num);
+	stream_table_remove(&poller->conns, ctx->id);
+	__atomic_sub_fetch(&poller->load, 1, __ATOMIC_RELAXED);
+
+	if (ctx->finish_pending) {
+		for (prev = &poller->finish_pending; *prev != ctx; prev = &(*prev)->finish_next);
+		*prev = ctx->finish_next;
+	}
+
+	if (ctx->last_wqe_pending) {
+		for (prev = &poller->last_wqe_pending; *prev != ctx; prev = &(*prev)->last_wqe_next);
+		*prev = ctx->last_wqe_next;
+	}
+
+	if (poller->closed) {
+		poller->closed(ctx, poller->closed_arg);
+	}
+	stream_close_ctx(ctx);
+}
+
+static void stream_poller_service(struct stream_poller *poller, struct stream_connect_ctx *ctx);
+
+/**
+ * Give back the messages the handler threads are done with. A connection
+ * that ended is looked at again once its last message is back. If the caller
+ * is in the middle of serving connections it waits on the pending list, as
+ * nothing else completes for it to be looked at again.
+ */
+static void stream_poller_take_back(struct stream_poller *poller, int service) {
+	struct stream_handoff_msg done;
+	struct stream_connect_ctx *ctx;
+	int i;
+
+	for (i = 0; i < poller->handoff->no_threads; ++i) {
+		while (stream_handoff_pop(poller->handoff, i, &done)) {
+			ctx = done.ctx;
+			poller->in_flight--;
+			if ((stream_return_recv(ctx, done.index) || done.failed) &&
+					ctx->state == STREAM_CONNECTED) {
+				ctx->state = STREAM_ERROR;
+			}
+
+			if (ctx->state == STREAM_CONNECTED || ctx->recv_held > 0) {
+				continue;
+			}
+			if (service) {
+				stream_poller_service(poller, ctx);
+			} else if (!ctx->finish_pending) {
+				ctx->finish_pending = 1;
+				ctx->finish_next = poller->finish_pending;
+				poller->finish_pending = ctx;
+			}
+		}
+	}
+}
+
+/**
+ * Pass the received messages of a connection to its handler thread
+ */
+static int stream_poller_hand_off(struct stream_poller *poller, struct stream_connect_ctx *ctx) {
+	struct stream_message msg;
+	uint32_t index;
+
+	while (stream_take_recv(ctx, &msg, &index)) {
+		// the thread is behind, make room by taking back what it is done with
+		while (stream_handoff_push(poller->handoff, ctx, &msg, index)) {
+			stream_poller_take_back(poller, 0);
+		}
+		poller->in_flight++;
+	}
+
+	return 0;
+}
+
+/**
+ * Take a connection down once it is done
+ */
+static void stream_poller_finish(struct stream_poller *poller, struct stream_connect_ctx *ctx) {
+	// nothing to wait for if the markers can't go out
+	if (ctx->state != STREAM_CONNECTED && !ctx->draining && stream_shutdown(ctx)) {
+		ctx->drained = ctx->draining;
+		ctx->last_wqe = 1;
+	}
+
+	// the handler threads may still be reading its buffers
+	if (!ctx->draining || ctx->drained != ctx->draining || ctx->recv_held > 0) {
+		return;
+	}
+
+	// a QP on a shared queue may take one more receive off it until the
+	// device says it is done, and that completes for nothing on the CQ
+	if (ctx->srq && !__atomic_load_n(&ctx->last_wqe, __ATOMIC_ACQUIRE)) {
+		if (!ctx->last_wqe_pending) {
+			ctx->last_wqe_pending = 1;
+			ctx->last_wqe_next = poller->last_wqe_pending;
+			poller->last_wqe_pending = ctx;
+		}
+		return;
+	}
+
+	stream_poller_close(poller, ctx);
+}
+
+/**
+ * Close the drained connections whose QP is done with the shared queue
+ */
+static void stream_poller_last_wqe(struct stream_poller *poller) {
+	struct stream_connect_ctx *ctx, **prev = &poller->last_wqe_pending;
+
+	while ((ctx = *prev)) {
+		if (!__atomic_load_n(&ctx->last_wqe, __ATOMIC_ACQUIRE)) {
+			prev = &ctx->last_wqe_next;
+			continue;
+		}
+		*prev = ctx->last_wqe_next;
+		ctx->last_wqe_pending = 0;
+		stream_poller_close(poller, ctx);
+	}
+}
+
+/**
+ * Deliver what the lanes of a merged stream received. The lanes wait on each
+ * other, so a failed one takes the rest down with it.
+ */
+static void stream_poller_service_lanes(struct stream_poller *poller, struct stream_lanes *lanes) {
+	struct stream_connect_ctx *ctx;
+	int i, failed = 0;
+
+	stream_lanes_dispatch(lanes);
+
+	for (i = 0; i < lanes->no_lanes; ++i) {
+		ctx = lanes->lanes[i];
+		failed |= ctx && ctx->state == STREAM_ERROR;
+	}
+
+	// closing the last lane would free the stream under the loop
+	stream_lanes_get(lanes);
+	for (i = 0; i < lanes->no_lanes; ++i) {
+		ctx = lanes->lanes[i];
+		if (!ctx) {
+			continue;
+		}
+		if (failed && ctx->state == STREAM_CONNECTED) {
+			ctx->state = STREAM_ERROR;
+		}
+		stream_poller_finish(poller, ctx);
+	}
+	stream_lanes_put(lanes);
+}
+
+/**
+ * Deliver what a connection received, and take it down once it is done
+ */
+static void stream_poller_service(struct stream_poller *poller, struct stream_connect_ctx *ctx) {
+	if (ctx->lanes && ctx->lanes->merge) {
+		stream_poller_service_lanes(poller, ctx->lanes);
+		return;
+	}
+
+	if (ctx->state == STREAM_CONNECTED && (poller->handoff ?
+			stream_poller_hand_off(poller, ctx) : stream_dispatch(ctx)) &&
+			ctx->state == STREAM_CONNECTED) {
+		ctx->state = STREAM_ERROR;
+	}
+
+	stream_poller_finish(poller, ctx);
+}
+
+/**
+ * Take down the connections that ended while the poller was busy
+ */
+static void stream_poller_finish_pending(struct stream_poller *poller) {
+	struct stream_connect_ctx *ctx;
+
+	while ((ctx = poller->finish_pending)) {
+		poller->finish_pending = ctx->finish_next;
+		ctx->finish_pending = 0;
+		stream_poller_service(poller, ctx);
+	}
+}
+
+int stream_poller_progress(struct stream_poller *poller) {
+	struct ibv_wc wc[STREAM_POLL_BATCH_MAX];
+	struct stream_connect_ctx *owners[STREAM_POLL_BATCH_MAX];
+	struct stream_connect_ctx *ctxs[STREAM_POLL_BATCH_MAX];
+	int ne, i, n = 0;
+
+	if (poller->handoff) {
+		stream_poller_take_back(poller, 1);
+		stream_poller_finish_pending(poller);
+	}
+	if (poller->last_wqe_pending) {
+		stream_poller_last_wqe(poller);
+	}
+
+	ne = ibv_poll_cq(poller->cq, poller->poll_batch, wc);
+	if (ne < 0) {
+		fprintf(stderr, "poll CQ failed %d\n", ne);
+		return -1;
+	}
+
+	if (ne == 0) {
+		return 0;
+	}
+
+	// the owners are looked up first, so the buffer of the next completion
+	// can be prefetched while one is handled
+	for (i = 0; i < ne; ++i) {
+		owners[i] = stream_table_lookup(&poller->table, wc[i].qp_num);
+	}
+
+	poller->round++;
+	for (i = 0; i < ne; ++i) {
+		if (i + 1 < ne && owners[i + 1]) {
+			stream_prefetch_wc(owners[i + 1], &wc[i + 1]);
+		}
+
+		if (!owners[i]) {
+			stream_poller_stale(poller, &wc[i]);
+			continue;
+		}
+
+		// a failure is recorded in the connection state
+		stream_handle_wc(owners[i], &wc[i]);
+
+		// service each connection once per batch, and merged lanes once
+		// for all of them as serving one may close the others
+		if (owners[i]->poll_round != poller->round && !(owners[i]->lanes &&
+				owners[i]->lanes->merge && owners[i]->lanes->poll_round == poller->round)) {
+			owners[i]->poll_round = poller->round;
+			if (owners[i]->lanes) {
+				owners[i]->lanes->poll_round = poller->round;
+			}
+			ctxs[n++] = owners[i];
+		}
+	}
+
+	// only the poller removes connections, so they stay valid
+	for (i = 0; i < n; ++i) {
+		stream_poller_service(poller, ctxs[i]);
+	}
+	stream_poller_finish_pending(poller);
+
+	return ne;
+}
+
+/**
+ * Sleep until the completion queue has something, or the timeout passes so a
+ * stop request is seen. Returns 1 if an event came.
+ */
+static int stream_poller_wait(struct stream_poller *poller) {
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	struct pollfd pfd = {
+		.fd = poller->channel->fd,
+		.events = POLLIN,
+	};
+
+	if (poll(&pfd, 1, STREAM_ASYNC_POLL_MS) <= 0) {
+		return 0;
+	}
+
+	if (ibv_get_cq_event(poller->channel, &ev_cq, &ev_ctx)) {
+		return 0;
+	}
+
+	stream_count_cq_event(poller->cq, &poller->num_cq_events);
+	return 1;
+}
+
+/**
+ * The spin budget ran out, arm the notification and sleep until the next
+ * completion
+ */
+static int stream_poller_sleep(struct stream_poller *poller) {
+	uint64_t start;
+	int ne;
+
+	if (ibv_req_notify_cq(poller->cq, 0)) {
+		fprintf(stderr, "Couldn't request CQ notification\n");
+		return 1;
+	}
+
+	// a completion that came in before the notify was armed raises no
+	// event, poll once more before going to sleep
+	ne = stream_poller_progress(poller);
+	if (ne != 0 || poller->in_flight || poller->last_wqe_pending) {
+		stream_spin_missed(&poller->spin);
+		return ne < 0;
+	}
+
+	start = stream_spin_now();
+	while (!poller->stop && !stream_poller_wait(poller));
+	stream_spin_woke(&poller->spin, stream_spin_now() - start);
+
+	return 0;
+}
+
+static void *stream_poller_thread(void *arg) {
+	struct stream_poller *poller = arg;
+	cpu_set_t cpus;
+	int ne;
+
+	if (poller->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(poller->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus)) {
+			fprintf(stderr, "Couldn't pin poller %d to core %d\n", poller->shard, poller->cpu);
+		}
+	}
+
+	while (!poller->stop) {
+		ne = stream_poller_progress(poller);
+		if (ne < 0) {
+			break;
+		}
+
+		// messages coming back from the handlers raise no event, nor does
+		// the end of a connection on a shared receive queue
+		if (poller->in_flight || poller->last_wqe_pending) {
+			ne = MAX(ne, 1);
+		}
+
+		if (poller->adaptive) {
+			if (stream_spin_idle(&poller->spin, ne) && stream_poller_sleep(poller)) {
+				break;
+			}
+		} else if (poller->channel && ne == 0 && stream_poller_wait(poller) &&
+				ibv_req_notify_cq(poller->cq, 0)) {
+			fprintf(stderr, "Couldn't request CQ notification\n");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+struct stream_poller *stream_poller_create(struct stream_device *dev,
+		struct stream_connect_cfg *cfg, int shard, int cpu,
+		stream_close_handler closed, void *closed_arg) {
+	struct stream_poller *poller;
+	int flags;
+
+	poller = calloc(1, sizeof *poller);
+	if (!poller) {
+		fprintf(stderr, "Couldn't allocate poller\n");
+		return NULL;
+	}
+	poller->dev = dev;
+	poller->shard = shard;
+	poller->cpu = cpu;
+	poller->next_id = shard;
+	poller->id_stride = MAX(cfg->shards, 1);
+	poller->closed = closed;
+	poller->closed_arg = closed_arg;
+
+	if (stream_table_init(&poller->table, STREAM_TABLE_INIT_SIZE)) {
+		goto error;
+	}
+
+	if (stream_table_init(&poller->conns, STREAM_TABLE_INIT_SIZE)) {
+		goto error;
+	}
+
+	poller->cq = stream_device_cq(dev, shard, 0, cfg->use_event || cfg->adaptive);
+	if (!poller->cq) {
+		goto error;
+	}
+	poller->channel = dev->cqs[shard].channel;
+	poller->adaptive = cfg->adaptive && poller->channel;
+	stream_spin_init(&poller->spin, cfg->spin_budget);
+	poller->poll_batch = stream_poll_batch(cfg);
+
+	if (cfg->handler_threads > 0) {
+		poller->handoff = stream_handoff_create(cfg->handler_threads, poller->id_stride);
+		if (!poller->handoff) {
+			goto error;
+		}
+	}
+
+	// events are read with a timeout so the thread can be stopped
+	if (poller->channel) {
+		flags = fcntl(poller->channel->fd, F_GETFL);
+		if (fcntl(poller->channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+			fprintf(stderr, "Couldn't make CQ events non blocking\n");
+			goto error;
+		}
+	}
+
+	if (pthread_create(&poller->thread, NULL, stream_poller_thread, poller)) {
+		fprintf(stderr, "Couldn't start poller thread\n");
+		goto error;
+	}
+
+	return poller;
+
+	error:
+	stream_handoff_destroy(poller->handoff);
+	if (poller->table.slots) {
+		stream_table_free(&poller->table);
+	}
+	if (poller->conns.slots) {
+		stream_table_free(&poller->conns);
+	}
+	free(poller);
+	return NULL;
+}
+
+int stream_poller_destroy(struct stream_poller *poller) {
+	struct stream_connect_ctx *ctx;
+	uint32_t pos = 0;
+
+	if (!poller) {
+		return 0;
+	}
+
+	poller->stop = 1;
+	pthread_join(poller->thread, NULL);
+	// the handlers may be using the connections
+	stream_handoff_destroy(poller->handoff);
+
+	// connections still open are cut off
+	while ((ctx = stream_table_next(&poller->table, &pos))) {
+		if (poller->closed) {
+			poller->closed(ctx, poller->closed_arg);
+		}
+		stream_close_ctx(ctx);
+	}
+
+	if (poller->num_cq_events) {
+		ibv_ack_cq_events(poller->cq, poller->num_cq_events);
+	}
+
+	stream_table_free(&poller->table);
+	stream_table_free(&poller->conns);
+	free(poller);
+	return 0;
+}
+
+int stream_poller_add(struct stream_poller *poller, struct stream_connect_ctx *ctx) {
+	ctx->id = __atomic_fetch_add(&poller->next_id, poller->id_stride, __ATOMIC_RELAXED);
+	if (stream_table_insert(&poller->conns, ctx->id, ctx)) {
+		fprintf(stderr, "Couldn't add connection %u\n", ctx->id);
+		return 1;
+	}
+
+	if (stream_table_insert(&poller->table, ctx->qp->qp_num, ctx)) {
+		fprintf(stderr, "Couldn't add connection of QP %u\n", ctx->qp->qp_num);
+		stream_table_remove(&poller->conns, ctx->id);
+		return 1;
+	}
+
+	__atomic_add_fetch(&poller->load, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int stream_poller_remove(struct stream_poller *poller, struct stream_connect_ctx *ctx) {
+	stream_table_remove(&poller->conns, ctx->id);
+	if (!stream_table_remove(&poller->table, ctx->qp->qp_num)) {
+		return 1;
+	}
+
+	__atomic_sub_fetch(&poller->load, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+struct stream_connect_ctx *stream_poller_find(struct stream_poller *poller, uint32_t id) {
+	return stream_table_lookup(&poller->conns, id);
+}
@@ -0,0 +1,93 @@
+#ifndef IBV_POLLER_H
+#define IBV_POLLER_H
+
+#include <pthread.h>
+
+#include "handoff.h"
+#include "stream.h"
+#include "table.h"
+
+/**
+ * A single thread draining a shared completion queue of a device for all the
+ * connections on it. Completions are routed to their connection by qp_num.
+ */
+struct stream_poller {
+	struct stream_device *dev;
+	// which of the shared queues of the device is polled
+	int shard;
+	struct ibv_cq *cq;
+	struct ibv_comp_channel *channel;
+	// connections by qp_num, for the completions
+	struct stream_table table;
+	// connections by id, for the application
+	struct stream_table conns;
+	// id of the next connection added, ids step over the other shards
+	uint32_t next_id;
+	uint32_t id_stride;
+	// no of connections on the poller
+	int load;
+	// core the thread runs on, -1 to leave it to the scheduler
+	int cpu;
+	// told about every connection that ends
+	stream_close_handler closed;
+	void *closed_arg;
+	// completion events not yet acknowledged
+	unsigned int num_cq_events;
+	// spin on the CQ while busy and only sleep on the channel once idle
+	int adaptive;
+	struct stream_spin spin;
+	// no of completions taken per poll
+	int poll_batch;
+	// threads running the handlers, NULL to run them on the poller
+	struct stream_handoff *handoff;
+	// messages with the handler threads, the poller doesn't sleep on them
+	int in_flight;
+	// connections to take down once the poller is done serving the others
+	struct stream_connect_ctx *finish_pending;
+	// drained connections on a shared receive queue waiting for their last
+	// receive to be taken off it
+	struct stream_connect_ctx *last_wqe_pending;
+	// counts the polls that found completions, marks the connections touched
+	uint64_t round;
+	pthread_t thread;
+	volatile int stop;
+};
+
+/**
+ * Create a poller for shared completion queue shard of the device and start
+ * its thread, pinned to cpu unless it is -1. Returns NULL on failure.
+ */
+struct stream_poller *stream_poller_create(struct stream_device *dev,
+		struct stream_connect_cfg *cfg, int shard, int cpu,
+		stream_close_handler closed, void *closed_arg);
+
+/**
+ * Stop the thread, close the connections left and free the poller
+ */
+int stream_poller_destroy(struct stream_poller *poller);
+
+/**
+ * Hand a connection on the shared completion queue to the poller, which
+ * closes it when it is done. The connection gets its id. Returns 1 on failure.
+ */
+int stream_poller_add(struct stream_poller *poller, struct stream_connect_ctx *ctx);
+
+/**
+ * Take back a connection that never got going, the caller closes it. Only
+ * safe while the peer can't have sent anything yet.
+ */
+int stream_poller_remove(struct stream_poller *poller, struct stream_connect_ctx *ctx);
+
+/**
+ * Find a connection by id, NULL if there is none. The connection is only
+ * valid until the poller closes it.
+ */
+struct stream_connect_ctx *stream_poller_find(struct stream_poller *poller, uint32_t id);
+
+/**
+ * Poll the completion queue once and service the connections that had
+ * completions. Returns the no of completions, -1 on failure.
+ */
+int stream_poller_progress(struct stream_poller *poller);
+
+#endif /* IBV_POLLER_H */
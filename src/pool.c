@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define STREAM_DEQUE_MASK (STREAM_DEQUE_SIZE - 1)
+
+static int stream_deque_push(struct stream_deque *deque, void *item) {
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= STREAM_DEQUE_SIZE) {
+		return 1;
+	}
+
+	__atomic_store_n(&deque->items[b & STREAM_DEQUE_MASK], item, __ATOMIC_RELAXED);
+	// the item is in place before a thief can see the new bottom
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void *stream_deque_pop(struct stream_deque *deque) {
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t t;
+	void *item;
+
+	// claim the bottom before looking at the top, a thief does the reverse
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	item = __atomic_load_n(&deque->items[b & STREAM_DEQUE_MASK], __ATOMIC_RELAXED);
+	if (t == b) {
+		// the last one, a thief may be after it too
+		if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			item = NULL;
+		}
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return item;
+}
+
+static void *stream_deque_steal(struct stream_deque *deque) {
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	int64_t b;
+	void *item;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return NULL;
+	}
+
+	item = __atomic_load_n(&deque->items[t & STREAM_DEQUE_MASK], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return item;
+}
+
+/**
+ * Take a task from another worker, starting with the next one so the thieves
+ * spread out
+ */
+static void *stream_pool_steal(struct stream_pool *pool, int self) {
+	void *item;
+	int i;
+
+	for (i = 1; i < pool->no_workers; ++i) {
+		item = stream_deque_steal(&pool->workers[(self + i) % pool->no_workers].deque);
+		if (item) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+static void *stream_pool_thread(void *arg) {
+	struct stream_worker *worker = arg;
+	struct stream_pool *pool = worker->pool;
+	void *item;
+
+	while (!pool->stop) {
+		item = stream_deque_pop(&worker->deque);
+		if (!item) {
+			item = stream_pool_steal(pool, worker->index);
+		}
+
+		if (item) {
+			pool->run(item, pool->arg);
+		} else {
+			pool->feed(pool, worker->index, pool->arg);
+		}
+	}
+
+	return NULL;
+}
+
+struct stream_pool *stream_pool_create(int no_workers, stream_pool_run run,
+		stream_pool_feed feed, void *arg) {
+	struct stream_pool *pool;
+	int i;
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool) {
+		fprintf(stderr, "Couldn't allocate worker pool\n");
+		return NULL;
+	}
+	pool->run = run;
+	pool->feed = feed;
+	pool->arg = arg;
+
+	pool->workers = calloc(no_workers, sizeof (struct stream_worker));
+	if (!pool->workers) {
+		fprintf(stderr, "Couldn't allocate workers\n");
+		free(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < no_workers; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+	}
+	// a worker may steal as soon as it starts, so all of them are counted
+	pool->no_workers = no_workers;
+
+	for (i = 0; i < no_workers; ++i) {
+		if (pthread_create(&pool->workers[i].thread, NULL, stream_pool_thread,
+				&pool->workers[i])) {
+			fprintf(stderr, "Couldn't start worker thread\n");
+			pool->stop = 1;
+			while (i-- > 0) {
+				pthread_join(pool->workers[i].thread, NULL);
+			}
+			free(pool->workers);
+			free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+int stream_pool_destroy(struct stream_pool *pool) {
+	int i;
+
+	if (!pool) {
+		return 0;
+	}
+
+	pool->stop = 1;
+	for (i = 0; i < pool->no_workers; ++i) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	free(pool->workers);
+	free(pool);
+	return 0;
+}
+
+int stream_pool_push(struct stream_pool *pool, int worker, void *item) {
+	return stream_deque_push(&pool->workers[worker].deque, item);
+}
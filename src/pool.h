@@ -0,0 +1,70 @@
+#ifndef IBV_POOL_H
+#define IBV_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// most tasks queued on a worker, a power of 2
+#define STREAM_DEQUE_SIZE 256
+
+/**
+ * Tasks of one worker. The worker pushes and pops at the bottom without a
+ * lock, idle workers steal from the top.
+ */
+struct stream_deque {
+	int64_t top;
+	int64_t bottom;
+	void *items[STREAM_DEQUE_SIZE];
+};
+
+struct stream_pool;
+
+/**
+ * Run a task
+ */
+typedef void (*stream_pool_run)(void *item, void *arg);
+
+/**
+ * Called by a worker that found nothing to run or steal, pushes new tasks on
+ * the worker. It may block, but only for a short while so a stop is seen.
+ */
+typedef void (*stream_pool_feed)(struct stream_pool *pool, int worker, void *arg);
+
+struct stream_worker {
+	struct stream_pool *pool;
+	int index;
+	pthread_t thread;
+	struct stream_deque deque;
+};
+
+/**
+ * A fixed set of threads running tasks. Each worker runs its own tasks first
+ * and steals from the others once it runs out, so a burst fed to one worker
+ * spreads over the idle ones.
+ */
+struct stream_pool {
+	struct stream_worker *workers;
+	int no_workers;
+	stream_pool_run run;
+	stream_pool_feed feed;
+	void *arg;
+	volatile int stop;
+};
+
+/**
+ * Start no_workers threads. Returns NULL on failure.
+ */
+struct stream_pool *stream_pool_create(int no_workers, stream_pool_run run,
+		stream_pool_feed feed, void *arg);
+
+/**
+ * Stop and join the workers, tasks still queued are dropped
+ */
+int stream_pool_destroy(struct stream_pool *pool);
+
+/**
+ * Queue a task on worker, only from that worker. Returns 1 if it is full.
+ */
+int stream_pool_push(struct stream_pool *pool, int worker, void *item);
+
+#endif /* IBV_POOL_H */
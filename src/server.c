@@ -13,35 +13,209 @@
 #include <sys/param.h>
 #include <pthread.h>
 
-#include "stream.h"
+#include "stream_verbs.h"
+#include "engine.h"
+#include "evloop.h"
+#include "lanes.h"
 
-#define MAX_CONNECTIONS 100
+// longest a client may take to send its connect message, the accept thread
+// serves one client at a time
+#define STREAM_ACCEPT_TIMEOUT_S 5
 
-int stream_process_messages(struct stream_connect_cfg *cfg, struct stream_connect_ctx *ctx);
+/**
+ * Per connection counters kept by the message handler
+ */
+struct stream_server_stats {
+	long long messages;
+	long long bytes;
+	struct timeval start;
+};
 
-struct stream_connections {
-	struct stream_connect_ctx *ctxs[MAX_CONNECTIONS];
-	int count;
+/**
+ * A device and port pair clients connect over
+ */
+struct stream_server_rail {
+	struct stream_rail rail;
+	struct stream_device *dev;
+	// pollers driving the connections on the device, shared by the rails on
+	// the same device
+	struct stream_engine *engine;
 };
 
 struct stream_tcp_server_info {
 	struct stream_connect_cfg *cfg;
-	struct stream_connections *conns;
+	// a client lane on its rail i comes in on rail i here, wrapping around
+	struct stream_server_rail rails[STREAM_MAX_RAILS];
+	int no_rails;
+	// or, in event mode with connections on their own CQs, these threads do
+	struct stream_evloop *evloop;
+	// connections accepted so far
+	uint32_t accepted;
+	// connections open now, and the most allowed at once, 0 for no limit
+	int live;
+	int max_conns;
+	// merged streams by id while their lanes come in, only the accept
+	// thread looks them up and takes them out
+	struct stream_table streams;
 };
 
-struct stream_tcp_server_worker_info {
-	struct stream_connect_cfg *cfg;
-	struct stream_connect_ctx *context;
-};
+static int stream_server_handle_message(struct stream_connect_ctx *ctx,
+		struct stream_message *msg, void *arg) {
+	struct stream_server_stats *stats = arg;
 
-void *stream_tcp_server_worker_thread(void *thread) {
-	struct stream_tcp_server_worker_info *tcp_worker = (struct stream_tcp_server_worker_info *) thread;
-	struct stream_connect_cfg *cfg = tcp_worker->cfg;
-	struct stream_connect_ctx *ctx = tcp_worker->context;
+	stats->messages++;
+	stats->bytes += msg->length;
+	return 0;
+}
 
-	printf("Start processing the request\n");
-	stream_process_messages(cfg, ctx);
-	return NULL;
+/**
+ * Report on a connection once the client closed it or it failed
+ */
+static void stream_server_closed(struct stream_connect_ctx *ctx, void *arg) {
+	struct stream_tcp_server_info *tcp_server = arg;
+	struct stream_server_stats *stats = ctx->handler_arg;
+	struct timeval end;
+
+	__atomic_sub_fetch(&tcp_server->live, 1, __ATOMIC_RELAXED);
+	if (ctx->lanes) {
+		stream_lanes_leave(ctx->lanes, ctx);
+	}
+
+	if (gettimeofday(&end, NULL)) {
+		perror("gettimeofday");
+	} else {
+		float usec = (end.tv_sec - stats->start.tv_sec) * 1000000 +
+				(end.tv_usec - stats->start.tv_usec);
+
+		printf("%s after %lld messages\n", ctx->state == STREAM_CLOSED ?
+				"Connection closed" : "Connection failed", stats->messages);
+		printf("%lld bytes in %.2f seconds = %.2f Mbit/sec\n",
+				stats->bytes, usec / 1000000., stats->bytes * 8. / usec);
+	}
+
+	free(stats);
+}
+
+/**
+ * Choose the completion vector of the next connection. On the pollers it is
+ * the least loaded shard, connections with their own CQs take turns.
+ */
+static int stream_server_pick(struct stream_tcp_server_info *tcp_server,
+		struct stream_server_rail *rail) {
+	if (tcp_server->evloop) {
+		return tcp_server->accepted++;
+	}
+	return stream_engine_pick(rail->engine);
+}
+
+/**
+ * Forget the streams a lane of left before all of them came in, the rest
+ * won't be asked for
+ */
+static void stream_server_sweep(struct stream_tcp_server_info *tcp_server) {
+	struct stream_lanes *lanes;
+	uint32_t pos = 0;
+
+	while ((lanes = stream_table_next(&tcp_server->streams, &pos))) {
+		if (__atomic_load_n(&lanes->abandoned, __ATOMIC_ACQUIRE)) {
+			stream_table_remove(&tcp_server->streams, lanes->id);
+			stream_lanes_put(lanes);
+		}
+	}
+}
+
+/**
+ * The merged stream a lane belongs to, created when its first lane comes in.
+ * All the lanes go to one poller, which merges them without locking.
+ */
+static struct stream_lanes *stream_server_lanes(struct stream_tcp_server_info *tcp_server,
+		struct stream_connect_message *conn_msg) {
+	struct stream_server_rail *rail = &tcp_server->rails[conn_msg->rail];
+	struct stream_lanes *lanes;
+
+	if (tcp_server->evloop || tcp_server->cfg->handler_threads) {
+		fprintf(stderr, "Merged lanes need the pollers without handler threads\n");
+		return NULL;
+	}
+
+	stream_server_sweep(tcp_server);
+	lanes = stream_table_lookup(&tcp_server->streams, conn_msg->connect_id);
+	if (lanes) {
+		// another client's stream with the same id
+		if (lanes->no_lanes != conn_msg->no_lanes) {
+			fprintf(stderr, "Lane of stream %u doesn't match the lanes joined so far\n",
+					lanes->id);
+			return NULL;
+		}
+		// a poller only drives the queues of its own device
+		if (lanes->dev != rail->dev) {
+			fprintf(stderr, "Lanes of merged stream %u are on more than one device\n",
+					lanes->id);
+			return NULL;
+		}
+		return lanes;
+	}
+
+	// the sender can't have more messages in flight than the lanes have credit
+	lanes = stream_lanes_create(conn_msg->connect_id, conn_msg->no_lanes, 1, rail->dev,
+			stream_engine_pick(rail->engine),
+			(uint64_t) conn_msg->no_lanes * tcp_server->cfg->rx_depth);
+	if (!lanes) {
+		return NULL;
+	}
+
+	if (stream_table_insert(&tcp_server->streams, lanes->id, lanes)) {
+		fprintf(stderr, "Couldn't add stream %u\n", lanes->id);
+		stream_lanes_put(lanes);
+		return NULL;
+	}
+	return lanes;
+}
+
+/**
+ * A lane joined, the stream is no longer looked up once all of them did
+ */
+static int stream_server_join(struct stream_tcp_server_info *tcp_server,
+		struct stream_lanes *lanes, struct stream_connect_ctx *ctx) {
+	if (stream_lanes_join(lanes, ctx)) {
+		return 1;
+	}
+
+	if (lanes->joined == lanes->no_lanes) {
+		stream_table_remove(&tcp_server->streams, lanes->id);
+		stream_lanes_put(lanes);
+	}
+	return 0;
+}
+
+/**
+ * Close a connection that never got going
+ */
+static void stream_server_drop(struct stream_connect_ctx *ctx) {
+	if (ctx->lanes) {
+		stream_lanes_leave(ctx->lanes, ctx);
+	}
+	stream_close_ctx(ctx);
+}
+
+/**
+ * Give a connection to whatever drives them
+ */
+static int stream_server_add(struct stream_tcp_server_info *tcp_server,
+		struct stream_connect_ctx *ctx) {
+	if (tcp_server->evloop) {
+		return stream_evloop_add(tcp_server->evloop, ctx);
+	}
+	return stream_engine_add(tcp_server->rails[ctx->rail].engine, ctx);
+}
+
+static void stream_server_remove(struct stream_tcp_server_info *tcp_server,
+		struct stream_connect_ctx *ctx) {
+	if (tcp_server->evloop) {
+		stream_evloop_remove(tcp_server->evloop, ctx);
+	} else {
+		stream_engine_remove(tcp_server->rails[ctx->rail].engine, ctx);
+	}
 }
 
 /**
@@ -50,6 +224,8 @@ void *stream_tcp_server_worker_thread(void *thread) {
 void *stream_tcp_server_thread(void *thread) {
 	struct stream_tcp_server_info *tcp_server = (struct stream_tcp_server_info *) thread;
 	struct stream_connect_cfg *cfg = tcp_server->cfg;
+	struct stream_connect_cfg conn_cfg = *cfg;
+	struct stream_server_rail *rail;
 
 	struct addrinfo *res, *t;
 	struct addrinfo hints = {
@@ -96,21 +272,45 @@ void *stream_tcp_server_thread(void *thread) {
 		return NULL;
 	}
 
-	listen(sockfd, 1);
-	char msg[sizeof "0000:000000:000000:00000000000000000000000000000000"];
+	// clients come back in bulk after a restart
+	listen(sockfd, SOMAXCONN);
+	char msg[STREAM_WIRE_CONNECT_SIZE];
 	while (1) {
 
 		int n;
 		int connfd;
-		struct stream_dest *rem_dest = NULL;
-		char gid[33];
+		struct stream_connect_message conn_msg;
 		struct stream_connect_ctx *ctx;
+		struct stream_server_stats *stats;
+		struct stream_lanes *lanes = NULL;
+		struct timeval timeout = {
+			.tv_sec = STREAM_ACCEPT_TIMEOUT_S,
+		};
+		// the connection counts as live from here until the poller owns it
+		int held = 1;
 
 		connfd = accept(sockfd, NULL, 0);
 		if (connfd < 0) {
 			fprintf(stderr, "accept() failed\n");
 			return NULL;
 		}
+		// a reconnect storm is turned away instead of piling up contexts.
+		// The slot is taken before anything is read, so the count can't
+		// fall behind the connections being set up.
+		if (__atomic_add_fetch(&tcp_server->live, 1, __ATOMIC_RELAXED) > tcp_server->max_conns &&
+				tcp_server->max_conns) {
+			__atomic_sub_fetch(&tcp_server->live, 1, __ATOMIC_RELAXED);
+			fprintf(stderr, "Refusing connection, %d open\n", tcp_server->max_conns);
+			close(connfd);
+			continue;
+		}
+
+		// a stalled client would hold up every other one
+		if (setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout)) {
+			perror("setsockopt");
+			goto out;
+		}
+
 		printf("Wait for new connection:\n");
 		n = read(connfd, msg, sizeof msg);
 		if (n != sizeof msg) {
@@ -119,276 +319,73 @@ void *stream_tcp_server_thread(void *thread) {
 			goto out;
 		}
 
-		rem_dest = malloc(sizeof *rem_dest);
-		if (!rem_dest) {
-			goto out;
+		wire_to_stream_connect_message(msg, &conn_msg);
+		conn_msg.rail %= tcp_server->no_rails;
+		rail = &tcp_server->rails[conn_msg.rail];
+
+		if (conn_msg.no_lanes > 1 && conn_msg.merge) {
+			lanes = stream_server_lanes(tcp_server, &conn_msg);
+			if (!lanes) {
+				goto out;
+			}
 		}
 
-		sscanf(msg, "%x:%x:%x:%s", &rem_dest->lid, &rem_dest->qpn, &rem_dest->psn, gid);
-		wire_gid_to_gid(gid, &rem_dest->gid);
+		stats = calloc(1, sizeof (struct stream_server_stats));
+		if (!stats) {
+			goto out;
+		}
 
 		printf("Connect context:\n");
-		ctx = stream_process_connect_request(cfg, rem_dest);
+		conn_cfg.ib_devname = rail->rail.devname;
+		conn_cfg.ib_port = rail->rail.port;
+		conn_cfg.comp_vector = lanes ? lanes->shard : stream_server_pick(tcp_server, rail);
+		ctx = stream_create_connection(&conn_cfg, &conn_msg);
 		if (!ctx) {
 			printf("Failed to connect context: \n");
+			free(stats);
+			goto out;
 		}
 		printf("Connected context:\n");
 
-	  int routs = stream_post_recv(ctx, ctx->rx_depth);
-		if (routs < ctx->rx_depth) {
-			fprintf(stderr, "Couldn't post receive (%d)\n", routs);
-			return 1;
+		gettimeofday(&stats->start, NULL);
+		stream_set_handler(ctx, stream_server_handle_message, stats);
+
+		if (lanes && stream_server_join(tcp_server, lanes, ctx)) {
+			stream_close_ctx(ctx);
+			free(stats);
+			goto out;
+		}
+
+		// the client sends once it has our address, the connection has
+		// to be driven by then
+		conn_msg.dest = ctx->self_dest;
+		conn_msg.credit = stream_take_credit(ctx);
+		if (stream_server_add(tcp_server, ctx)) {
+			stream_server_drop(ctx);
+			free(stats);
+			goto out;
 		}
 
-		gid_to_wire_gid(&ctx->self_dest.gid, gid);
-		sprintf(msg, "%04x:%06x:%06x:%s", ctx->self_dest.lid, ctx->self_dest.qpn, ctx->self_dest.psn, gid);
+		stream_connect_message_to_wire(&conn_msg, msg);
 		if (write(connfd, msg, sizeof msg) != sizeof msg) {
 			fprintf(stderr, "Couldn't send local address\n");
-			free(rem_dest);
-			rem_dest = NULL;
+			stream_server_remove(tcp_server, ctx);
+			stream_server_drop(ctx);
+			free(stats);
 			goto out;
 		}
+		// the close handler gives the slot back from now on
+		held = 0;
 
 		printf("Connected context 2 \n");
 		read(connfd, msg, sizeof msg);
 
-		pthread_t worker_thread;
-		struct stream_tcp_server_worker_info * worker_ctx = calloc(1, sizeof (struct stream_tcp_server_worker_info));
-		if (!worker_ctx) {
-			return NULL;
-		}
-		worker_ctx->cfg = cfg;
-		worker_ctx->context = ctx;
-
-		// start the TCP server thread for accepting incoming communications
-		if (pthread_create(&worker_thread, NULL, stream_tcp_server_worker_thread,
-				(void *) worker_ctx)) {
-			fprintf(stderr, "Couldn't create worker thread\n");
-			goto out;
-		}
-
 		out:
-		close(connfd);
-	}
-}
-
-int stream_process_messages(struct stream_connect_cfg *cfg, struct stream_connect_ctx *ctx) {
-	struct timeval start, end;
-
-	int iters = 1000;
-	int routs = ctx->rx_depth;
-	int rcnt, scnt;
-	int num_cq_events = 0;
-
-    printf("steram process messages \n");
-	ctx->pending = STREAM_RECV_WRID;
-
-	if (gettimeofday(&start, NULL)) {
-		perror("gettimeofday");
-		return 1;
-	}
-
-	rcnt = scnt = 0;
-	while (rcnt < iters || scnt < iters) {
-		if (cfg->use_event) {
-			struct ibv_cq *ev_cq;
-			void          *ev_ctx;
-
-			if (ibv_get_cq_event(ctx->channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get cq_event\n");
-				return 1;
-			}
-
-			++num_cq_events;
-
-			if (ev_cq != ctx->cq) {
-				fprintf(stderr, "CQ event for unknown CQ %p\n", ev_cq);
-				return 1;
-			}
-
-			if (ibv_req_notify_cq(ctx->cq, 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				return 1;
-			}
+		if (held) {
+			__atomic_sub_fetch(&tcp_server->live, 1, __ATOMIC_RELAXED);
 		}
-
-		{
-			struct ibv_wc wc[2];
-			int ne, i;
-			do {
-				ne = ibv_poll_cq(ctx->cq, 2, wc);
-				if (ne < 0) {
-					fprintf(stderr, "poll CQ failed %d\n", ne);
-					return 1;
-				}
-
-			} while (!cfg->use_event && ne < 1);
-
-			for (i = 0; i < ne; ++i) {
-				if (wc[i].status != IBV_WC_SUCCESS) {
-					fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-							ibv_wc_status_str(wc[i].status),
-							wc[i].status, (int) wc[i].wr_id);
-					return 1;
-				}
-
-				switch ((int) wc[i].wr_id) {
-				case STREAM_SEND_WRID:
-					++scnt;
-					break;
-
-				case STREAM_RECV_WRID:
-					if (--routs <= 1) {
-						routs += stream_post_recv(ctx, ctx->rx_depth - routs);
-						if (routs < ctx->rx_depth) {
-							fprintf(stderr,
-									"Couldn't post receive (%d)\n",
-									routs);
-							return 1;
-						}
-					}
-
-					++rcnt;
-					break;
-
-				default:
-					fprintf(stderr, "Completion for unknown wr_id %d\n",
-							(int) wc[i].wr_id);
-					return 1;
-				}
-
-				ctx->pending &= ~(int) wc[i].wr_id;
-				if (scnt < iters && !ctx->pending) {
-					if (stream_post_send(ctx)) {
-						fprintf(stderr, "Couldn't post send\n");
-						return 1;
-					}
-					ctx->pending = STREAM_RECV_WRID |
-							STREAM_SEND_WRID;
-				}
-			}
-		}
-	}
-
-	if (gettimeofday(&end, NULL)) {
-		perror("gettimeofday");
-		return 1;
-	}
-
-	{
-		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
-				(end.tv_usec - start.tv_usec);
-		long long bytes = (long long) cfg->size * iters * 2;
-
-		printf("%lld bytes in %.2f seconds = %.2f Mbit/sec\n",
-				bytes, usec / 1000000., bytes * 8. / usec);
-		printf("%d iters in %.2f seconds = %.2f usec/iter\n",
-				iters, usec / 1000000., usec / iters);
-	}
-
-	ibv_ack_cq_events(ctx->cq, num_cq_events);
-
-	if (stream_close_ctx(ctx))
-		return 1;
-
-	return 0;
-}
-
-static struct stream_dest *stream_server_exch_dest(struct stream_connect_cfg *cfg,
-		struct stream_connect_ctx *ctx,
-		int ib_port, enum ibv_mtu mtu,
-		int port, int sl,
-		const struct stream_dest *my_dest,
-		int sgid_idx) {
-	struct addrinfo *res, *t;
-	struct addrinfo hints = {
-			.ai_flags    = AI_PASSIVE,
-			.ai_family   = AF_INET,
-			.ai_socktype = SOCK_STREAM
-	};
-	char *service;
-	char msg[sizeof "0000:000000:000000:00000000000000000000000000000000"];
-	int n;
-	int sockfd = -1, connfd;
-	struct stream_dest *rem_dest = NULL;
-	char gid[33];
-
-	if (asprintf(&service, "%d", port) < 0)
-		return NULL;
-
-	n = getaddrinfo(NULL, service, &hints, &res);
-
-	if (n < 0) {
-		fprintf(stderr, "%s for port %d\n", gai_strerror(n), port);
-		free(service);
-		return NULL;
-	}
-
-	for (t = res; t; t = t->ai_next) {
-		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
-		if (sockfd >= 0) {
-			n = 1;
-
-			setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof n);
-
-			if (!bind(sockfd, t->ai_addr, t->ai_addrlen))
-				break;
-			close(sockfd);
-			sockfd = -1;
-		}
-	}
-
-	freeaddrinfo(res);
-	free(service);
-
-	if (sockfd < 0) {
-		fprintf(stderr, "Couldn't listen to port %d\n", port);
-		return NULL;
-	}
-
-	listen(sockfd, 1);
-	connfd = accept(sockfd, NULL, 0);
-	close(sockfd);
-	if (connfd < 0) {
-		fprintf(stderr, "accept() failed\n");
-		return NULL;
-	}
-
-	n = read(connfd, msg, sizeof msg);
-	if (n != sizeof msg) {
-		perror("server read");
-		fprintf(stderr, "%d/%d: Couldn't read remote address\n", n, (int) sizeof msg);
-		goto out;
-	}
-
-	rem_dest = malloc(sizeof *rem_dest);
-	if (!rem_dest)
-		goto out;
-
-	sscanf(msg, "%x:%x:%x:%s", &rem_dest->lid, &rem_dest->qpn, &rem_dest->psn, gid);
-	wire_gid_to_gid(gid, &rem_dest->gid);
-
-	if (stream_connect_ctx(cfg, ctx)) {
-		fprintf(stderr, "Couldn't connect to remote QP\n");
-		free(rem_dest);
-		rem_dest = NULL;
-		goto out;
-	}
-
-	gid_to_wire_gid(&my_dest->gid, gid);
-	sprintf(msg, "%04x:%06x:%06x:%s", my_dest->lid, my_dest->qpn, my_dest->psn, gid);
-	if (write(connfd, msg, sizeof msg) != sizeof msg) {
-		fprintf(stderr, "Couldn't send local address\n");
-		free(rem_dest);
-		rem_dest = NULL;
-		goto out;
+		close(connfd);
 	}
-
-	read(connfd, msg, sizeof msg);
-
-	out:
-	close(connfd);
-	return rem_dest;
 }
 
 static void usage(const char *argv0){
@@ -398,14 +395,34 @@ static void usage(const char *argv0){
 	printf("\n");
 	printf("Options:\n");
 	printf("  -p, --port=<port>      listen on/connect to port <port> (default 18515)\n");
-	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default the one on the node the\n");
+	printf("                         process is bound to, else the first found)\n");
 	printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
 	printf("  -s, --size=<size>      size of message to exchange (default 4096)\n");
 	printf("  -m, --mtu=<size>       path MTU (default 1024)\n");
-	printf("  -r, --rx-depth=<dep>   number of receives to post at a time (default 500)\n");
-	printf("  -n, --iters=<iters>    number of exchanges (default 1000)\n");
+	printf("  -r, --rx-depth=<dep>   number of receives to post at a time (default 12)\n");
+	printf("  -t, --tx-depth=<dep>   number of sends outstanding at a time (default 16)\n");
+	printf("  -c, --signal=<n>       ask for a completion every n sends (default 1)\n");
+	printf("  -I, --inline=<size>    max size of message to send inline (default 256)\n");
+	printf("  -w, --rx-watermark=<n> refill receives when n are left posted (default rx-depth / 2)\n");
+	printf("  -q, --srq=<n>          share a receive queue of n buffers between clients,\n");
+	printf("                         rx-depth becomes the credit of each client (default off)\n");
+	printf("  -Q, --srq-limit=<n>    refill the shared receive queue below n (default srq / 4)\n");
 	printf("  -l, --sl=<sl>          service level value\n");
 	printf("  -e, --events           sleep on CQ events (default poll)\n");
+	printf("  -a, --adaptive         poll while busy, sleep on CQ events once idle\n");
+	printf("  -b, --spin=<n>         empty polls before sleeping with -a (default tuned)\n");
+	printf("  -P, --poll-batch=<n>   completions taken per poll, up to 64 (default 16)\n");
+	printf("  -C, --max-conns=<n>    refuse clients while n are connected (default no limit)\n");
+	printf("  -S, --shards=<n>       pollers, each on its own core and shared CQ (default 1)\n");
+	printf("  -H, --handler-threads=<n> run the message handlers on n threads per poller\n");
+	printf("                         instead of on the poller (default 0)\n");
+	printf("  -E, --event-threads=<n> give each client its own CQ and serve them\n");
+	printf("                         from n threads sleeping in epoll (default off)\n");
+	printf("  -R, --rails=<dev:port,..> take clients over these device and port pairs\n");
+	printf("  -k, --reserve=<MB>     map, lock and register MB of hugepages per device at start\n");
+	printf("                         to carve the buffers from. Without it, buffers under 2MB\n");
+	printf("                         are on normal pages (default off)\n");
 	printf("  -g, --gid-idx=<gid index> local port gid index\n");
 }
 
@@ -416,9 +433,13 @@ int main(int argc, char *argv[]) {
 	int num_cq_events = 0;
 	int	gidx = -1;
 	char gid[33];
-	int iters;
 	// server thread
 	pthread_t server_thread;
+	int max_conns = 0;
+	char *rails = NULL;
+	size_t reserve = 0;
+	struct stream_rail rail_list[STREAM_MAX_RAILS];
+	int i, j, first_poller = 0;
 
 	struct stream_connect_cfg *cfg;
 	cfg = calloc(1, sizeof (struct stream_connect_cfg));
@@ -443,14 +464,28 @@ int main(int argc, char *argv[]) {
 				{ .name = "size",     .has_arg = 1, .val = 's' },
 				{ .name = "mtu",      .has_arg = 1, .val = 'm' },
 				{ .name = "rx-depth", .has_arg = 1, .val = 'r' },
-				{ .name = "iters",    .has_arg = 1, .val = 'n' },
+				{ .name = "tx-depth", .has_arg = 1, .val = 't' },
+				{ .name = "signal",   .has_arg = 1, .val = 'c' },
+				{ .name = "inline",   .has_arg = 1, .val = 'I' },
+				{ .name = "rx-watermark", .has_arg = 1, .val = 'w' },
+				{ .name = "srq",      .has_arg = 1, .val = 'q' },
+				{ .name = "srq-limit", .has_arg = 1, .val = 'Q' },
 				{ .name = "sl",       .has_arg = 1, .val = 'l' },
 				{ .name = "events",   .has_arg = 0, .val = 'e' },
+				{ .name = "adaptive", .has_arg = 0, .val = 'a' },
+				{ .name = "spin",     .has_arg = 1, .val = 'b' },
+				{ .name = "poll-batch", .has_arg = 1, .val = 'P' },
+				{ .name = "max-conns", .has_arg = 1, .val = 'C' },
+				{ .name = "shards",   .has_arg = 1, .val = 'S' },
+				{ .name = "handler-threads", .has_arg = 1, .val = 'H' },
+				{ .name = "event-threads", .has_arg = 1, .val = 'E' },
+				{ .name = "rails",    .has_arg = 1, .val = 'R' },
+				{ .name = "reserve",  .has_arg = 1, .val = 'k' },
 				{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
 				{ 0 }
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:s:m:r:t:c:I:w:q:Q:l:eab:P:C:S:H:E:R:k:g:", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -491,8 +526,28 @@ int main(int argc, char *argv[]) {
 			cfg->rx_depth = strtol(optarg, NULL, 0);
 			break;
 
-		case 'n':
-			iters = strtol(optarg, NULL, 0);
+		case 't':
+			cfg->tx_depth = strtol(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			cfg->signal_interval = strtol(optarg, NULL, 0);
+			break;
+
+		case 'I':
+			cfg->max_inline = strtol(optarg, NULL, 0);
+			break;
+
+		case 'w':
+			cfg->rx_watermark = strtol(optarg, NULL, 0);
+			break;
+
+		case 'q':
+			cfg->srq_depth = strtol(optarg, NULL, 0);
+			break;
+
+		case 'Q':
+			cfg->srq_limit = strtol(optarg, NULL, 0);
 			break;
 
 		case 'l':
@@ -503,6 +558,42 @@ int main(int argc, char *argv[]) {
 			++cfg->use_event;
 			break;
 
+		case 'a':
+			cfg->adaptive = 1;
+			break;
+
+		case 'b':
+			cfg->spin_budget = strtol(optarg, NULL, 0);
+			break;
+
+		case 'P':
+			cfg->poll_batch = strtol(optarg, NULL, 0);
+			break;
+
+		case 'C':
+			max_conns = strtol(optarg, NULL, 0);
+			break;
+
+		case 'S':
+			cfg->shards = strtol(optarg, NULL, 0);
+			break;
+
+		case 'H':
+			cfg->handler_threads = strtol(optarg, NULL, 0);
+			break;
+
+		case 'E':
+			cfg->event_threads = strtol(optarg, NULL, 0);
+			break;
+
+		case 'R':
+			rails = optarg;
+			break;
+
+		case 'k':
+			reserve = strtoull(optarg, NULL, 0) << 20;
+			break;
+
 		case 'g':
 			gidx = strtol(optarg, NULL, 0);
 			break;
@@ -519,6 +610,70 @@ int main(int argc, char *argv[]) {
 	if (!tcp_server) {
 		return 1;
 	}
+	tcp_server->max_conns = max_conns;
+	if (stream_table_init(&tcp_server->streams, STREAM_TABLE_INIT_SIZE)) {
+		return 1;
+	}
+
+	if (rails) {
+		tcp_server->no_rails = stream_parse_rails(rails, rail_list, STREAM_MAX_RAILS);
+	} else {
+		rail_list[0].devname = cfg->ib_devname;
+		rail_list[0].port = cfg->ib_port;
+		tcp_server->no_rails = 1;
+	}
+	if (tcp_server->no_rails < 1) {
+		return 1;
+	}
+
+	for (i = 0; i < tcp_server->no_rails; ++i) {
+		tcp_server->rails[i].rail = rail_list[i];
+		tcp_server->rails[i].dev = stream_device_get(tcp_server->rails[i].rail.devname);
+		if (!tcp_server->rails[i].dev) {
+			return 1;
+		}
+
+		// the buffers of the connections are carved from it, ports of a
+		// device share it
+		for (j = 0; j < i && tcp_server->rails[j].dev != tcp_server->rails[i].dev; ++j);
+		if (reserve && j == i && stream_device_reserve(tcp_server->rails[i].dev, reserve)) {
+			return 1;
+		}
+	}
+
+	if (cfg->event_threads > 0) {
+		// each connection sleeps on its own channel, a few threads wait
+		// on all of them
+		cfg->use_event = 1;
+		tcp_server->evloop = stream_evloop_create(cfg->event_threads,
+				stream_server_closed, tcp_server);
+		if (!tcp_server->evloop) {
+			return 1;
+		}
+	} else {
+		// the connections share the completion queues of the device, a
+		// poller per queue drives them
+		cfg->shared_cq = 1;
+		for (i = 0; i < tcp_server->no_rails; ++i) {
+			// the ports of a device share its queues and pollers
+			for (j = 0; j < i; ++j) {
+				if (tcp_server->rails[j].dev == tcp_server->rails[i].dev) {
+					tcp_server->rails[i].engine = tcp_server->rails[j].engine;
+					break;
+				}
+			}
+			if (j < i) {
+				continue;
+			}
+
+			tcp_server->rails[i].engine = stream_engine_create(tcp_server->rails[i].dev,
+					cfg, first_poller, stream_server_closed, tcp_server);
+			if (!tcp_server->rails[i].engine) {
+				return 1;
+			}
+			first_poller += cfg->shards;
+		}
+	}
 
 	tcp_server->cfg = cfg;
 	// start the TCP server thread for accepting incoming communications
@@ -530,5 +685,14 @@ int main(int argc, char *argv[]) {
 	// wait until the tcp thread finishes
 	pthread_join(server_thread, NULL);
 
+	stream_evloop_destroy(tcp_server->evloop);
+	for (i = 0; i < tcp_server->no_rails; ++i) {
+		for (j = 0; j < i && tcp_server->rails[j].dev != tcp_server->rails[i].dev; ++j);
+		if (j == i) {
+			stream_engine_destroy(tcp_server->rails[i].engine);
+		}
+		stream_device_put(tcp_server->rails[i].dev);
+	}
+
 	return 0;
 }
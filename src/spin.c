@@ -0,0 +1,64 @@
+#include <sys/param.h>
+
+#include "spin.h"
+
+static uint64_t stream_spin_ns(const struct timespec *ts) {
+	return (uint64_t) ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+uint64_t stream_spin_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return stream_spin_ns(&ts);
+}
+
+void stream_spin_init(struct stream_spin *spin, uint32_t budget) {
+	spin->fixed = budget > 0;
+	spin->budget = budget > 0 ? budget : STREAM_SPIN_START;
+	spin->idle = 0;
+	spin->spun = 0;
+	spin->stale = 0;
+}
+
+int stream_spin_idle(struct stream_spin *spin, int ne) {
+	struct timespec now;
+
+	if (ne > 0) {
+		spin->idle = 0;
+		return 0;
+	}
+
+	// the clock is only read at the edges of a run of empty polls
+	if (spin->idle++ == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &spin->idle_start);
+	}
+
+	if (spin->idle < spin->budget) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	spin->spun = stream_spin_ns(&now) - stream_spin_ns(&spin->idle_start);
+	spin->idle = 0;
+	return 1;
+}
+
+void stream_spin_missed(struct stream_spin *spin) {
+	spin->stale = 1;
+}
+
+void stream_spin_woke(struct stream_spin *spin, uint64_t slept) {
+	if (spin->fixed || spin->stale) {
+		spin->stale = 0;
+		return;
+	}
+
+	// woken before the spin would have run out, spinning longer would
+	// have caught it without the wake up
+	if (slept < spin->spun) {
+		spin->budget = MIN(spin->budget * 2, STREAM_SPIN_MAX);
+	} else if (slept > spin->spun * 8) {
+		spin->budget = MAX(spin->budget / 2, STREAM_SPIN_MIN);
+	}
+}
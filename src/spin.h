@@ -0,0 +1,63 @@
+#ifndef IBV_SPIN_H
+#define IBV_SPIN_H
+
+#include <stdint.h>
+#include <time.h>
+
+// bounds and start of a self tuned spin budget, in empty polls
+#define STREAM_SPIN_MIN 64
+#define STREAM_SPIN_MAX (1 << 20)
+#define STREAM_SPIN_START 4096
+
+/**
+ * Decides when a poll loop stops spinning and sleeps on the completion
+ * channel. The loop spins for budget empty polls in a row before it sleeps.
+ * Unless the budget is fixed it is tuned on every wake up: an event right
+ * after going to sleep means the loop gave up too early, a long sleep means it
+ * spun for nothing.
+ */
+struct stream_spin {
+	// empty polls before sleeping
+	uint32_t budget;
+	// the budget was configured, don't tune it
+	int fixed;
+	// empty polls in a row so far
+	uint32_t idle;
+	// when the current run of empty polls started
+	struct timespec idle_start;
+	// how long the last run of empty polls took, in ns
+	uint64_t spun;
+	// an event may be waiting from a sleep that was called off, the next
+	// wake up says nothing about the budget
+	int stale;
+};
+
+/**
+ * Start with the given budget, 0 to tune it
+ */
+void stream_spin_init(struct stream_spin *spin, uint32_t budget);
+
+/**
+ * Account for a poll that found ne completions. Returns 1 once the budget is
+ * used up and the loop should sleep.
+ */
+int stream_spin_idle(struct stream_spin *spin, int ne);
+
+/**
+ * The last poll before sleeping found completions, so the loop goes on
+ * without sleeping. The notification stays armed and its event wakes the next
+ * sleep at once.
+ */
+void stream_spin_missed(struct stream_spin *spin);
+
+/**
+ * The loop slept for slept ns before an event woke it up
+ */
+void stream_spin_woke(struct stream_spin *spin, uint64_t slept);
+
+/**
+ * Monotonic time in ns
+ */
+uint64_t stream_spin_now(void);
+
+#endif /* IBV_SPIN_H */
@@ -0,0 +1,226 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "srq.h"
+#include "stream.h"
+
+/**
+ * Ask for an event once the posted receives drop below the limit. The event
+ * fires once, so it is armed again after every refill.
+ */
+static int stream_srq_arm(struct stream_srq *srq) {
+	struct ibv_srq_attr attr = {
+		.srq_limit = srq->limit,
+	};
+
+	if (ibv_modify_srq(srq->srq, &attr, IBV_SRQ_LIMIT)) {
+		fprintf(stderr, "Couldn't arm SRQ limit\n");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Refill the queue whenever the device says it is running low, and tell the
+ * connections on it when their QP is done with it
+ */
+static void *stream_srq_async_thread(void *arg) {
+	struct stream_srq *srq = arg;
+	struct ibv_context *context = srq->dev->context;
+	struct ibv_async_event event;
+	struct stream_connect_ctx *ctx;
+	struct pollfd pfd = {
+		.fd = context->async_fd,
+		.events = POLLIN,
+	};
+
+	while (!srq->stop) {
+		if (poll(&pfd, 1, STREAM_ASYNC_POLL_MS) <= 0) {
+			continue;
+		}
+
+		if (ibv_get_async_event(context, &event)) {
+			continue;
+		}
+
+		if (event.event_type == IBV_EVENT_SRQ_LIMIT_REACHED &&
+				event.element.srq == srq->srq) {
+			stream_srq_refill(srq);
+		}
+
+		// the QP is in error and done with the queue, its poller may close
+		// it. Destroying the QP waits for the event to be acknowledged, so
+		// the connection is still there.
+		if (event.event_type == IBV_EVENT_QP_LAST_WQE_REACHED) {
+			ctx = event.element.qp->qp_context;
+			__atomic_store_n(&ctx->last_wqe, 1, __ATOMIC_RELEASE);
+		}
+		ibv_ack_async_event(&event);
+	}
+
+	return NULL;
+}
+
+struct stream_srq *stream_srq_create(struct stream_device *dev, uint32_t size,
+		uint32_t buf_size, uint32_t limit, size_t align) {
+	struct stream_srq *srq;
+	uint32_t i;
+	int flags;
+	struct ibv_srq_init_attr attr = {
+		.attr = {
+			.max_wr  = size,
+			.max_sge = 1,
+		},
+	};
+
+	srq = calloc(1, sizeof *srq);
+	if (!srq) {
+		fprintf(stderr, "Couldn't allocate SRQ\n");
+		return NULL;
+	}
+	srq->dev = dev;
+	srq->size = size;
+	srq->buf_size = buf_size;
+	srq->limit = limit;
+	pthread_mutex_init(&srq->lock, NULL);
+
+	srq->free_bufs = calloc(size, sizeof (uint32_t));
+	srq->wrs = calloc(size, sizeof (struct ibv_recv_wr));
+	srq->sges = calloc(size, sizeof (struct ibv_sge));
+	if (!srq->free_bufs || !srq->wrs || !srq->sges) {
+		fprintf(stderr, "Couldn't allocate SRQ requests\n");
+		goto error;
+	}
+
+	srq->mem = stream_mem_get(dev, (size_t) size * buf_size, align);
+	if (!srq->mem) {
+		goto error;
+	}
+
+	// lowest index on top, so the pool is handed out from the start
+	for (i = 0; i < size; ++i) {
+		srq->free_bufs[i] = size - i - 1;
+	}
+	srq->no_free = size;
+
+	srq->srq = ibv_create_srq(dev->pd, &attr);
+	if (!srq->srq) {
+		fprintf(stderr, "Couldn't create SRQ\n");
+		goto error;
+	}
+
+	if (stream_srq_refill(srq)) {
+		goto error;
+	}
+
+	// events are read with a timeout so the thread can be stopped
+	flags = fcntl(dev->context->async_fd, F_GETFL);
+	if (fcntl(dev->context->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		fprintf(stderr, "Couldn't make async events non blocking\n");
+		goto error;
+	}
+
+	if (pthread_create(&srq->async_thread, NULL, stream_srq_async_thread, srq)) {
+		fprintf(stderr, "Couldn't start SRQ event thread\n");
+		goto error;
+	}
+
+	return srq;
+
+	error:
+	if (srq->srq) {
+		ibv_destroy_srq(srq->srq);
+	}
+	stream_mem_put(dev, srq->mem);
+	free(srq->free_bufs);
+	free(srq->wrs);
+	free(srq->sges);
+	pthread_mutex_destroy(&srq->lock);
+	free(srq);
+	return NULL;
+}
+
+int stream_srq_destroy(struct stream_srq *srq) {
+	if (!srq) {
+		return 0;
+	}
+
+	srq->stop = 1;
+	pthread_join(srq->async_thread, NULL);
+
+	if (ibv_destroy_srq(srq->srq)) {
+		fprintf(stderr, "Couldn't destroy SRQ\n");
+		return 1;
+	}
+
+	if (stream_mem_put(srq->dev, srq->mem)) {
+		return 1;
+	}
+
+	free(srq->free_bufs);
+	free(srq->wrs);
+	free(srq->sges);
+	pthread_mutex_destroy(&srq->lock);
+	free(srq);
+	return 0;
+}
+
+int stream_srq_refill(struct stream_srq *srq) {
+	struct ibv_recv_wr *bad_wr = NULL;
+	uint32_t i, n, index, posted;
+	uint8_t *base = srq->mem->buf;
+	int err = 0;
+
+	pthread_mutex_lock(&srq->lock);
+	n = srq->no_free;
+	// the buffers stay on the stack until they are posted
+	for (i = 0; i < n; ++i) {
+		index = srq->free_bufs[srq->no_free - i - 1];
+		srq->sges[i].addr = (uintptr_t) (base + (uint64_t) index * srq->buf_size);
+		srq->sges[i].length = srq->buf_size;
+		srq->sges[i].lkey = srq->mem->mr->lkey;
+		srq->wrs[i].wr_id = STREAM_WRID(STREAM_SRQ_WRID, index);
+		srq->wrs[i].sg_list = &srq->sges[i];
+		srq->wrs[i].num_sge = 1;
+		srq->wrs[i].next = i == n - 1 ? NULL : &srq->wrs[i + 1];
+	}
+
+	posted = n;
+	if (n > 0 && (err = ibv_post_srq_recv(srq->srq, srq->wrs, &bad_wr))) {
+		fprintf(stderr, "Couldn't post SRQ receive\n");
+		posted = bad_wr ? bad_wr - srq->wrs : 0;
+	}
+	srq->no_free -= posted;
+	posted = __atomic_add_fetch(&srq->posted, posted, __ATOMIC_RELAXED);
+
+	// below the limit the event won't come, releases drive the refill
+	srq->starved = posted < srq->limit;
+	if (!srq->starved && stream_srq_arm(srq)) {
+		err = 1;
+	}
+	pthread_mutex_unlock(&srq->lock);
+
+	return err ? 1 : 0;
+}
+
+uint8_t *stream_srq_received(struct stream_srq *srq, uint32_t index) {
+	__atomic_sub_fetch(&srq->posted, 1, __ATOMIC_RELAXED);
+	return stream_srq_buf(srq, index);
+}
+
+void stream_srq_release(struct stream_srq *srq, uint8_t *buf) {
+	uint32_t index = (buf - (uint8_t *) srq->mem->buf) / srq->buf_size;
+	int refill;
+
+	pthread_mutex_lock(&srq->lock);
+	srq->free_bufs[srq->no_free++] = index;
+	refill = srq->starved && (srq->no_free >= srq->limit ||
+			__atomic_load_n(&srq->posted, __ATOMIC_RELAXED) == 0);
+	pthread_mutex_unlock(&srq->lock);
+
+	if (refill) {
+		stream_srq_refill(srq);
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef IBV_SRQ_H
+#define IBV_SRQ_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+#include "device.h"
+
+// how often the async event thread looks for a stop request, in ms
+#define STREAM_ASYNC_POLL_MS 100
+
+/**
+ * A shared receive queue with its own pool of registered buffers. All the
+ * connections on a device receive from it, so the receive memory doesn't grow
+ * with the number of connections. Buffers are either free, posted to the SRQ,
+ * or held by a connection until the application consumes the message.
+ */
+struct stream_srq {
+	struct stream_device *dev;
+	struct ibv_srq *srq;
+	// memory of the buffer pool
+	struct stream_mem *mem;
+	uint32_t size;
+	uint32_t buf_size;
+	// indexes of the free buffers, used as a stack
+	uint32_t *free_bufs;
+	uint32_t no_free;
+	// receives currently posted, updated without the lock from completions
+	uint32_t posted;
+	// the device raises an event once the posted receives drop below this
+	uint32_t limit;
+	// the last refill couldn't reach the limit, refill as buffers come back
+	int starved;
+	// chain of requests reused for every refill
+	struct ibv_recv_wr *wrs;
+	struct ibv_sge *sges;
+	pthread_mutex_t lock;
+	// thread refilling the queue on the limit event
+	pthread_t async_thread;
+	volatile int stop;
+};
+
+/**
+ * Create a shared receive queue of size buffers of buf_size bytes, post all of
+ * them and start watching for the limit event. Returns NULL on failure.
+ */
+struct stream_srq *stream_srq_create(struct stream_device *dev, uint32_t size,
+		uint32_t buf_size, uint32_t limit, size_t align);
+
+/**
+ * Stop the event thread and release the queue, the queue pairs using it must
+ * be gone
+ */
+int stream_srq_destroy(struct stream_srq *srq);
+
+/**
+ * Post every free buffer to the queue
+ */
+int stream_srq_refill(struct stream_srq *srq);
+
+/**
+ * The buffer at index of the pool
+ */
+static inline uint8_t *stream_srq_buf(struct stream_srq *srq, uint32_t index) {
+	return (uint8_t *) srq->mem->buf + (uint64_t) index * srq->buf_size;
+}
+
+/**
+ * A receive of buffer index completed, returns the buffer
+ */
+uint8_t *stream_srq_received(struct stream_srq *srq, uint32_t index);
+
+/**
+ * Give a buffer back to the pool once its message is consumed
+ */
+void stream_srq_release(struct stream_srq *srq, uint8_t *buf);
+
+#endif /* IBV_SRQ_H */
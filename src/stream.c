@@ -1,5 +1,6 @@
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -17,9 +18,34 @@ void stream_init_cfg(struct stream_connect_cfg *cfg) {
 	cfg->size = 4096;
 	cfg->mtu = IBV_MTU_1024;
 	cfg->rx_depth = 12;
+	cfg->tx_depth = 16;
 	cfg->use_event = 0;
+	cfg->adaptive = 0;
+	cfg->spin_budget = 0;
+	cfg->poll_batch = STREAM_POLL_BATCH;
 	cfg->sl = 0;
 	cfg->gidx = -1;
+	cfg->credit_threshold = 0;
+	cfg->signal_interval = 1;
+	cfg->max_inline = 256;
+	cfg->rx_watermark = 0;
+	cfg->srq_depth = 0;
+	cfg->srq_limit = 0;
+	cfg->shared_cq = 0;
+	cfg->event_threads = 0;
+	cfg->shards = 1;
+	cfg->handler_threads = 0;
+	cfg->submit_depth = 0;
+	cfg->connect_id = 0;
+	cfg->lane = 0;
+	cfg->no_lanes = 0;
+	cfg->merge = 0;
+	cfg->rail = 0;
+	cfg->comp_vector = 0;
+}
+
+int stream_poll_batch(struct stream_connect_cfg *cfg) {
+	return MAX(1, MIN(cfg->poll_batch, STREAM_POLL_BATCH_MAX));
 }
 
 enum ibv_mtu stream_mtu_to_enum(int mtu) {
@@ -34,36 +60,13 @@ enum ibv_mtu stream_mtu_to_enum(int mtu) {
 }
 
 int stream_assign_device(struct stream_connect_cfg *cfg, struct stream_connect_ctx *ctx) {
-	struct ibv_device **dev_list;
-	struct ibv_device *ib_dev;
-	dev_list = ibv_get_device_list(NULL);
-	if (!dev_list) {
-		perror("Failed to get IB devices list");
+	ctx->dev = stream_device_get(cfg->ib_devname);
+	if (!ctx->dev) {
 		return 1;
 	}
 
-	if (!cfg->ib_devname) {
-		ib_dev = *dev_list;
-		if (!ib_dev) {
-			fprintf(stderr, "No IB devices found\n");
-			return 1;
-		}
-	} else {
-		int i;
-		for (i = 0; dev_list[i]; ++i) {
-			if (!strcmp(ibv_get_device_name(dev_list[i]), cfg->ib_devname)) {
-				break;
-			}
-		}
-		ib_dev = dev_list[i];
-		if (!ib_dev) {
-			fprintf(stderr, "IB device %s not found\n", cfg->ib_devname);
-			return 1;
-		}
-	}
-
-	ctx->dev_list = dev_list;
-	ctx->device = ib_dev;
+	ctx->context = ctx->dev->context;
+	ctx->pd = ctx->dev->pd;
 
 	return 0;
 }
@@ -72,70 +75,204 @@ int stream_assign_device(struct stream_connect_cfg *cfg, struct stream_connect_c
  * Initialize the stream context by creating the infiniband objects
  */
 int stream_init_ctx(struct stream_connect_cfg *cfg, struct stream_connect_ctx *ctx) {
+	int buf_size;
+	size_t total;
+	struct stream_mempolicy policy;
+	struct ibv_device_attr dev_attr;
+
 	ctx->size     = cfg->size;
 	ctx->rx_depth = cfg->rx_depth;
+	ctx->tx_depth = cfg->tx_depth;
 
-	ctx->buf = malloc(roundup(cfg->size, cfg->page_size));
-	if (!ctx->buf) {
-		fprintf(stderr, "Couldn't allocate work buf.\n");
+	if (cfg->size < STREAM_MESSAGE_OVERHEAD) {
+		fprintf(stderr, "Message size %d smaller than header %d\n",
+				cfg->size, (int) STREAM_MESSAGE_OVERHEAD);
 		return 1;
 	}
 
-	memset(ctx->buf, 0x7b + !cfg->servername, cfg->size);
-
-	ctx->context = ibv_open_device(ctx->device);
-	if (!ctx->context) {
-		fprintf(stderr, "Couldn't get context for %s\n",
-				ibv_get_device_name(ctx->device));
+	// credit goes on the wire in 16 bits, a deeper queue would wrap it
+	if (cfg->rx_depth < 1 || cfg->rx_depth > UINT16_MAX) {
+		fprintf(stderr, "Receive depth must be between 1 and %d\n", UINT16_MAX);
 		return 1;
 	}
 
-	ctx->channel = NULL;
-	if (cfg->use_event) {
-		ctx->channel = ibv_create_comp_channel(ctx->context);
-		if (!ctx->channel) {
-			fprintf(stderr, "Couldn't create completion channel\n");
+	// the last credit is kept for credit updates, so the backlog has to
+	// go out before the peer runs dry
+	ctx->credit = 0;
+	ctx->credit_return = 0;
+	ctx->credit_threshold = cfg->credit_threshold ? cfg->credit_threshold : cfg->rx_depth / 2;
+	ctx->credit_threshold = MAX(1, MIN(ctx->credit_threshold, cfg->rx_depth - 1));
+	ctx->sequence = 0;
+	ctx->connect_id = cfg->connect_id;
+	ctx->lane = cfg->lane;
+	ctx->no_lanes = cfg->no_lanes;
+	ctx->merge = cfg->merge;
+	ctx->rail = cfg->rail;
+
+	ctx->signal_interval = MAX(1, MIN(cfg->signal_interval, cfg->tx_depth));
+	ctx->unsignaled = 0;
+
+	ctx->adaptive = cfg->adaptive;
+	stream_spin_init(&ctx->spin, cfg->spin_budget);
+	ctx->poll_batch = stream_poll_batch(cfg);
+
+	// send and receive rings are carved from one page aligned region
+	buf_size = roundup(cfg->size, STREAM_BUF_ALIGN);
+	total = roundup((size_t) buf_size * (cfg->tx_depth + cfg->rx_depth), cfg->page_size);
+
+	// with a shared receive queue only the send buffers are per connection,
+	// rx_depth is the credit the peer gets
+	if (cfg->srq_depth > 0) {
+		uint32_t limit = cfg->srq_limit ? cfg->srq_limit : cfg->srq_depth / 4;
+
+		ctx->srq = stream_device_srq(ctx->dev, cfg->srq_depth, buf_size,
+				MAX(1, MIN(limit, cfg->srq_depth - 1)), cfg->page_size);
+		if (!ctx->srq) {
 			return 1;
 		}
+		total = roundup((size_t) buf_size * cfg->tx_depth, cfg->page_size);
+	}
+
+	// regions left by closed connections are reused, so a burst of
+	// reconnects doesn't register memory again
+	ctx->mem = stream_mem_get(ctx->dev, total, cfg->page_size);
+	if (!ctx->mem) {
+		return 1;
+	}
+	ctx->buf = ctx->mem->buf;
+	ctx->mr = ctx->mem->mr;
+
+	if (stream_buffer_init(&ctx->send_buf, ctx->buf, cfg->tx_depth, buf_size)) {
+		return 1;
 	}
 
-	ctx->pd = ibv_alloc_pd(ctx->context);
-	if (!ctx->pd) {
-		fprintf(stderr, "Couldn't allocate PD\n");
+	if (ctx->srq) {
+		// filled in as the shared buffers arrive
+		if (stream_buffer_init(&ctx->recv_buf, NULL, cfg->rx_depth, 0)) {
+			return 1;
+		}
+	} else if (stream_buffer_init(&ctx->recv_buf, (uint8_t *) ctx->buf + (size_t) buf_size * cfg->tx_depth,
+			cfg->rx_depth, buf_size)) {
 		return 1;
 	}
 
-	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, cfg->size, IBV_ACCESS_LOCAL_WRITE);
-	if (!ctx->mr) {
-		fprintf(stderr, "Couldn't register MR\n");
+	ctx->recv_wrs = calloc(cfg->rx_depth, sizeof (struct ibv_recv_wr));
+	ctx->recv_sges = calloc(cfg->rx_depth, sizeof (struct ibv_sge));
+	if (!ctx->recv_wrs || !ctx->recv_sges) {
+		fprintf(stderr, "Couldn't allocate receive requests\n");
 		return 1;
 	}
 
-	ctx->cq = ibv_create_cq(ctx->context, cfg->rx_depth + 1, NULL,
-			ctx->channel, 0);
-	if (!ctx->cq) {
-		fprintf(stderr, "Couldn't create CQ\n");
+	ctx->send_wrs = calloc(cfg->tx_depth, sizeof (struct ibv_send_wr));
+	ctx->send_sges = calloc(cfg->tx_depth, sizeof (struct ibv_sge));
+	if (!ctx->send_wrs || !ctx->send_sges) {
+		fprintf(stderr, "Couldn't allocate send requests\n");
 		return 1;
 	}
 
+	if (cfg->submit_depth > 0) {
+		// its ends are kept on their own cache lines
+		if (posix_memalign((void **) &ctx->submit, 64, sizeof (struct stream_submit))) {
+			ctx->submit = NULL;
+			fprintf(stderr, "Couldn't allocate submission queue\n");
+			return 1;
+		}
+		if (stream_submit_init(ctx->submit, cfg->submit_depth,
+				cfg->size - STREAM_MESSAGE_OVERHEAD)) {
+			free(ctx->submit);
+			ctx->submit = NULL;
+			return 1;
+		}
+	}
+
+	// refill once the posted receives drop to the watermark
+	ctx->rx_watermark = cfg->rx_watermark ? cfg->rx_watermark : cfg->rx_depth / 2;
+	ctx->rx_watermark = MAX(1, MIN(ctx->rx_watermark, cfg->rx_depth - 1));
+
+	ctx->channel = NULL;
+	ctx->comp_vector = cfg->comp_vector;
+	if (cfg->shared_cq) {
+		// whoever polls the device queue waits on its channel
+		ctx->cq = stream_device_cq(ctx->dev, cfg->comp_vector,
+				cfg->rx_depth + cfg->tx_depth + 2, cfg->use_event || cfg->adaptive);
+		if (!ctx->cq) {
+			return 1;
+		}
+		ctx->shared_cq = 1;
+	} else {
+		if (cfg->use_event || cfg->adaptive) {
+			ctx->channel = ibv_create_comp_channel(ctx->context);
+			if (!ctx->channel) {
+				fprintf(stderr, "Couldn't create completion channel\n");
+				return 1;
+			}
+		}
+
+		stream_device_prefer(ctx->dev, &policy);
+		ctx->cq = ibv_create_cq(ctx->context, cfg->rx_depth + cfg->tx_depth + 2, NULL,
+				ctx->channel, stream_device_comp_vector(ctx->dev, cfg->comp_vector));
+		stream_device_unprefer(ctx->dev, &policy);
+		if (!ctx->cq) {
+			fprintf(stderr, "Couldn't create CQ\n");
+			return 1;
+		}
+	}
+
 	struct ibv_qp_init_attr init_attr = {
+			.qp_context = ctx,
 			.send_cq = ctx->cq,
 			.recv_cq = ctx->cq,
+			.srq     = ctx->srq ? ctx->srq->srq : NULL,
 			.cap     = {
-					.max_send_wr  = 1,
-					.max_recv_wr  = cfg->rx_depth,
+					// one more each for the drain markers
+					.max_send_wr  = cfg->tx_depth + 1,
+					.max_recv_wr  = ctx->srq ? 0 : cfg->rx_depth + 1,
 					.max_send_sge = 1,
-					.max_recv_sge = 1
+					.max_recv_sge = 1,
+					.max_inline_data = cfg->max_inline
 			},
 			.qp_type = IBV_QPT_RC
 	};
 
-	ctx->qp = ibv_create_qp(ctx->pd, &init_attr);
+	// the depths are checked here, so a QP the device rejects as invalid
+	// is down to the inline size, which the device doesn't report
+	if (ibv_query_device(ctx->context, &dev_attr)) {
+		fprintf(stderr, "Couldn't query device\n");
+		return 1;
+	}
+	if (init_attr.cap.max_send_wr > (uint32_t) dev_attr.max_qp_wr ||
+			init_attr.cap.max_recv_wr > (uint32_t) dev_attr.max_qp_wr) {
+		fprintf(stderr, "Depth over the device limit of %d work requests\n",
+				dev_attr.max_qp_wr - 1);
+		return 1;
+	}
+
+	// the work queues go on the node of the device like the buffers, and
+	// devices reject inline sizes they can't do, halve it until one fits
+	stream_device_prefer(ctx->dev, &policy);
+	while (!(ctx->qp = ibv_create_qp(ctx->pd, &init_attr)) && errno == EINVAL &&
+			init_attr.cap.max_inline_data > 0) {
+		init_attr.cap.max_inline_data /= 2;
+	}
+	stream_device_unprefer(ctx->dev, &policy);
+
 	if (!ctx->qp)  {
-		fprintf(stderr, "Couldn't create QP\n");
+		fprintf(stderr, "Couldn't create QP: %s\n", strerror(errno));
 		return 1;
 	}
 
+	// the device may give more than asked for, use what it reports
+	{
+		struct ibv_qp_attr qp_attr;
+		struct ibv_qp_init_attr qp_init_attr;
+
+		if (ibv_query_qp(ctx->qp, &qp_attr, IBV_QP_CAP, &qp_init_attr)) {
+			fprintf(stderr, "Couldn't query QP\n");
+			return 1;
+		}
+		ctx->max_inline = qp_attr.cap.max_inline_data;
+	}
+
 	struct ibv_qp_attr attr = {
 			.qp_state        = IBV_QPS_INIT,
 			.pkey_index      = 0,
@@ -152,7 +289,7 @@ int stream_init_ctx(struct stream_connect_cfg *cfg, struct stream_connect_ctx *c
 		return 1;
 	}
 
-	if (cfg->use_event) {
+	if (ctx->channel) {
 		if (ibv_req_notify_cq(ctx->cq, 0)) {
 			fprintf(stderr, "Couldn't request CQ notification\n");
 			return 1;
@@ -185,24 +322,64 @@ int stream_init_ctx(struct stream_connect_cfg *cfg, struct stream_connect_ctx *c
 	return 0;
 }
 
+/**
+ * Hand the shared buffers held by the connection back to the pool. Receives the
+ * QP took from the queue but didn't finish are flushed by moving it to error.
+ */
+static void stream_drain_srq(struct stream_connect_ctx *ctx) {
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_ERR,
+	};
+	struct ibv_wc wc[STREAM_POLL_BATCH_MAX];
+	int ne, i;
+
+	while (ctx->recv_buf.used) {
+		stream_release_recv(ctx, ctx->recv_buf.tail);
+	}
+
+	// a shared queue was drained through stream_shutdown by its poller
+	if (ctx->shared_cq) {
+		return;
+	}
+
+	if (!ctx->qp || !ctx->cq || ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
+		return;
+	}
+
+	while ((ne = ibv_poll_cq(ctx->cq, STREAM_POLL_BATCH_MAX, wc)) > 0) {
+		for (i = 0; i < ne; ++i) {
+			if (STREAM_WRID_TYPE(wc[i].wr_id) == STREAM_SRQ_WRID) {
+				stream_srq_release(ctx->srq, stream_srq_received(ctx->srq,
+						STREAM_WRID_INDEX(wc[i].wr_id)));
+			}
+		}
+	}
+}
+
 int stream_close_ctx(struct stream_connect_ctx *ctx) {
-	if (ibv_destroy_qp(ctx->qp)) {
-		fprintf(stderr, "Couldn't destroy QP\n");
-		return 1;
+	// a context that failed half way through init is closed as well
+	if (!ctx) {
+		return 0;
 	}
 
-	if (ibv_destroy_cq(ctx->cq)) {
-		fprintf(stderr, "Couldn't destroy CQ\n");
-		return 1;
+	if (ctx->cq && !ctx->shared_cq && ctx->num_cq_events) {
+		ibv_ack_cq_events(ctx->cq, ctx->num_cq_events);
 	}
 
-	if (ibv_dereg_mr(ctx->mr)) {
-		fprintf(stderr, "Couldn't deregister MR\n");
+	if (ctx->srq) {
+		stream_drain_srq(ctx);
+	}
+
+	if (ctx->qp && ibv_destroy_qp(ctx->qp)) {
+		fprintf(stderr, "Couldn't destroy QP\n");
 		return 1;
 	}
 
-	if (ibv_dealloc_pd(ctx->pd)) {
-		fprintf(stderr, "Couldn't deallocate PD\n");
+	if (ctx->shared_cq) {
+		stream_device_cq_release(ctx->dev, ctx->comp_vector,
+				ctx->rx_depth + ctx->tx_depth + 2);
+	} else if (ctx->cq && ibv_destroy_cq(ctx->cq)) {
+		fprintf(stderr, "Couldn't destroy CQ\n");
 		return 1;
 	}
 
@@ -213,16 +390,26 @@ int stream_close_ctx(struct stream_connect_ctx *ctx) {
 		}
 	}
 
-	if (ibv_close_device(ctx->context)) {
-		fprintf(stderr, "Couldn't release context\n");
+	// the memory and the device stay open for the next connection
+	if (ctx->mem && stream_mem_put(ctx->dev, ctx->mem)) {
 		return 1;
 	}
 
-	if (ctx->dev_list) {
-		ibv_free_device_list(ctx->dev_list);
+	if (stream_device_put(ctx->dev)) {
+		return 1;
 	}
 
-	free(ctx->buf);
+	stream_buffer_free(&ctx->send_buf);
+	stream_buffer_free(&ctx->recv_buf);
+	free(ctx->recv_wrs);
+	free(ctx->recv_sges);
+	free(ctx->send_wrs);
+	free(ctx->send_sges);
+	if (ctx->submit) {
+		stream_submit_free(ctx->submit);
+		free(ctx->submit);
+	}
+	free(ctx->rem_dest);
 	free(ctx);
 
 	return 0;
@@ -286,73 +473,320 @@ int stream_connect_ctx(struct stream_connect_cfg *cfg, struct stream_connect_ctx
 }
 
 int stream_post_recv_single(struct stream_connect_ctx *ctx) {
-	int err, retries;
+	return stream_post_recv(ctx, 1) == 1 ? 0 : 1;
+}
 
-	struct ibv_sge list = {
-		.addr	= (uintptr_t) ctx->buf,
-		.length = ctx->size,
-		.lkey	= ctx->mr->lkey
-	};
-	struct ibv_recv_wr wr = {
-		.wr_id = STREAM_RECV_WRID,
-		.sg_list = &list,
-		.num_sge = 1,
-	};
-	struct ibv_recv_wr *bad_wr;
+int stream_post_recv(struct stream_connect_ctx *ctx, int n) {
+	struct ibv_recv_wr *bad_wr = NULL;
+	int i, index, err, retries, posted;
+
+	n = MIN(n, (int) stream_buffer_free_count(&ctx->recv_buf));
+	if (n <= 0) {
+		return 0;
+	}
+
+	// link the whole batch so it goes to the HCA with a single doorbell
+	for (i = 0; i < n; ++i) {
+		index = stream_buffer_acquire(&ctx->recv_buf);
+		ctx->recv_sges[i].addr = (uintptr_t) ctx->recv_buf.bufs[index];
+		ctx->recv_sges[i].length = ctx->size;
+		ctx->recv_sges[i].lkey = ctx->mr->lkey;
+		ctx->recv_wrs[i].wr_id = STREAM_WRID(STREAM_RECV_WRID, index);
+		ctx->recv_wrs[i].sg_list = &ctx->recv_sges[i];
+		ctx->recv_wrs[i].num_sge = 1;
+		ctx->recv_wrs[i].next = i == n - 1 ? NULL : &ctx->recv_wrs[i + 1];
+	}
 
 	retries = MAX_RETRIES;
 	do {
-		ibv_post_recv(ctx->qp, &wr, &bad_wr);
+		err = ibv_post_recv(ctx->qp, ctx->recv_wrs, &bad_wr);
 	} while(err && --retries);
 
-	return err;
+	// everything from the failed request on was not posted
+	posted = n;
+	if (err) {
+		posted = bad_wr ? bad_wr - ctx->recv_wrs : 0;
+		for (i = posted; i < n; ++i) {
+			stream_buffer_cancel(&ctx->recv_buf);
+		}
+	}
+
+	// every posted receive is a credit we owe the peer
+	ctx->credit_return += posted;
+	return posted;
 }
 
-int stream_post_recv(struct stream_connect_ctx *ctx, int n) {
-	//printf("recv message\n");
-	struct ibv_sge list = {
-		.addr	= (uintptr_t) ctx->buf,
-		.length = ctx->size,
-		.lkey	= ctx->mr->lkey
-	};
-	struct ibv_recv_wr wr = {
-		.wr_id = STREAM_RECV_WRID,
-		.sg_list = &list,
-		.num_sge = 1,
+void stream_release_recv(struct stream_connect_ctx *ctx, uint32_t index) {
+	if (ctx->srq) {
+		stream_srq_release(ctx->srq, ctx->recv_buf.bufs[index]);
+		// the peer gets the credit back once the message is consumed
+		ctx->credit_return++;
+	}
+	stream_buffer_release(&ctx->recv_buf, index);
+}
+
+uint16_t stream_take_credit(struct stream_connect_ctx *ctx) {
+	uint16_t credit = MIN(ctx->credit_return, UINT16_MAX);
+	ctx->credit_return -= credit;
+	return credit;
+}
+
+int stream_send_signaled(struct stream_connect_ctx *ctx, int force) {
+	// a full ring can only drain through a signaled send, so the last
+	// free buffer always asks for a completion
+	if (force || ++ctx->unsignaled >= ctx->signal_interval ||
+			stream_buffer_free_count(&ctx->send_buf) == 0) {
+		ctx->unsignaled = 0;
+		return 1;
+	}
+	return 0;
+}
+
+int stream_prepare_send(struct stream_connect_ctx *ctx, uint8_t type,
+		const void *data, uint64_t length, struct ibv_send_wr *wr, struct ibv_sge *sge) {
+	return stream_prepare_part(ctx, type, 0, data, length, wr, sge);
+}
+
+int stream_prepare_part(struct stream_connect_ctx *ctx, uint8_t type, uint16_t part,
+		const void *data, uint64_t length, struct ibv_send_wr *wr, struct ibv_sge *sge) {
+	int index;
+	uint8_t *buf;
+	struct stream_message msg = {
+		.head = 1,
+		.type = type,
+		.part = part,
+		.length = length,
+		.tail = 1,
 	};
-	struct ibv_recv_wr *bad_wr;
-	int i;
-	for (i = 0; i < n; ++i) {
-		if (ibv_post_recv(ctx->qp, &wr, &bad_wr)) {
-			break;
+
+	index = stream_buffer_acquire(&ctx->send_buf);
+	if (index < 0) {
+		return -1;
+	}
+
+	buf = ctx->send_buf.bufs[index];
+	// lanes merged at the receiver number their messages together
+	msg.sequence = ctx->shared_sequence && type == STREAM_MESSAGE_DATA ?
+			__atomic_fetch_add(ctx->shared_sequence, 1, __ATOMIC_RELAXED) : ctx->sequence;
+	msg.credit = stream_take_credit(ctx);
+	stream_data_message_header_to_buffer(&msg, buf);
+	if (data) {
+		memcpy(buf + STREAM_MESSAGE_HEADER_SIZE, data, length);
+	}
+	buf[STREAM_MESSAGE_HEADER_SIZE + length] = msg.tail;
+
+	sge->addr = (uintptr_t) buf;
+	sge->length = STREAM_MESSAGE_OVERHEAD + length;
+	sge->lkey = ctx->mr->lkey;
+
+	memset(wr, 0, sizeof *wr);
+	wr->wr_id = STREAM_WRID(type == STREAM_MESSAGE_CREDIT ? STREAM_CREDIT_WRID : STREAM_SEND_WRID, index);
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_SEND;
+
+	// small messages are copied into the work request, so the HCA doesn't
+	// have to read the buffer back over PCIe
+	if (sge->length <= ctx->max_inline) {
+		wr->send_flags |= IBV_SEND_INLINE;
+	}
+
+	ctx->credit--;
+	if (type == STREAM_MESSAGE_DATA) {
+		ctx->sequence++;
+	}
+	return index;
+}
+
+void stream_cancel_send(struct stream_connect_ctx *ctx, struct ibv_send_wr *wr) {
+	struct stream_message msg;
+
+	// the peer wasn't told, keep the credit and the buffer
+	stream_data_message_header_from_buffer(ctx->send_buf.bufs[STREAM_WRID_INDEX(wr->wr_id)], &msg);
+	ctx->credit_return += msg.credit;
+	ctx->credit++;
+	if (msg.type == STREAM_MESSAGE_DATA) {
+		ctx->sequence--;
+		// other lanes may have taken later numbers, the merged stream would
+		// wait for this one forever
+		if (ctx->shared_sequence) {
+			ctx->state = STREAM_ERROR;
 		}
 	}
-	return i;
+	stream_buffer_cancel(&ctx->send_buf);
+}
+
+int stream_post_send_chain(struct stream_connect_ctx *ctx, struct ibv_send_wr *wrs, int n,
+		int signal) {
+	struct ibv_send_wr *bad_wr = NULL;
+	int unsignaled = ctx->unsignaled;
+	int i, err, retries, posted;
+
+	if (n <= 0) {
+		return 0;
+	}
+
+	// only the last request asks for a completion, it retires the whole chain
+	for (i = 0; i < n - 1; ++i) {
+		wrs[i].next = &wrs[i + 1];
+	}
+	wrs[n - 1].next = NULL;
+	ctx->unsignaled += n - 1;
+	if (stream_send_signaled(ctx, signal)) {
+		wrs[n - 1].send_flags |= IBV_SEND_SIGNALED;
+	}
+
+	retries = MAX_RETRIES;
+	do {
+		err = ibv_post_send(ctx->qp, wrs, &bad_wr);
+	} while(err && --retries);
+
+	if (err) {
+		posted = bad_wr ? bad_wr - wrs : 0;
+		// buffers go back in the reverse order they were taken
+		for (i = n - 1; i >= posted; --i) {
+			stream_cancel_send(ctx, &wrs[i]);
+		}
+		ctx->unsignaled = unsignaled + posted;
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Post a message of the given type from the next send buffer, consuming one credit.
+ * The send asks for a completion when signal is set or the signal interval is up.
+ */
+static int stream_post_message(struct stream_connect_ctx *ctx, uint8_t type, uint64_t length,
+		int signal) {
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+
+	if (stream_prepare_send(ctx, type, NULL, length, &wr, &sge) < 0) {
+		return EAGAIN;
+	}
+
+	return stream_post_send_chain(ctx, &wr, 1, signal);
 }
 
 int stream_post_send(struct stream_connect_ctx *ctx) {
-	//printf("send message\n");
-	int err, retries;
-	struct ibv_sge list = {
-		.addr = (uintptr_t) ctx->buf,
-		.length = ctx->size,
-		.lkey = ctx->mr->lkey
+	// never send data the peer has no receive for, the last credit is
+	// kept for credit updates
+	if (ctx->credit <= 1) {
+		return EAGAIN;
+	}
+
+	return stream_post_message(ctx, STREAM_MESSAGE_DATA, ctx->size - STREAM_MESSAGE_OVERHEAD, 0);
+}
+
+int stream_send_window(struct stream_connect_ctx *ctx) {
+	return MAX(0, MIN((int) stream_buffer_free_count(&ctx->send_buf), ctx->credit - 1));
+}
+
+int stream_post_window(struct stream_connect_ctx *ctx, int n) {
+	int i;
+
+	n = MIN(n, stream_send_window(ctx));
+	for (i = 0; i < n; ++i) {
+		stream_prepare_send(ctx, STREAM_MESSAGE_DATA, NULL, ctx->size - STREAM_MESSAGE_OVERHEAD,
+				&ctx->send_wrs[i], &ctx->send_sges[i]);
+	}
+
+	// the last send of the burst is signaled so its buffers don't sit
+	// waiting for a send that may never come
+	if (stream_post_send_chain(ctx, ctx->send_wrs, n, 1)) {
+		return -1;
+	}
+
+	return n;
+}
+
+int stream_post_credit(struct stream_connect_ctx *ctx) {
+	int err;
+
+	if (ctx->credit_return < ctx->credit_threshold || ctx->credit < 1) {
+		return 0;
+	}
+
+	// credit updates are rare and may be the last send for a while
+	err = stream_post_message(ctx, STREAM_MESSAGE_CREDIT, 0, 1);
+	// out of send buffers, try again after the next send completion
+	return err == EAGAIN ? 0 : err;
+}
+
+int stream_process_recv(struct stream_connect_ctx *ctx, uint8_t *buf, struct stream_message *msg) {
+	stream_data_message_header_from_buffer(buf, msg);
+	ctx->credit += msg->credit;
+	return msg->type;
+}
+
+/**
+ * Map a completion back to its buffer and hand the buffer back to its ring.
+ * Returns the buffer the completion refers to.
+ */
+uint8_t *stream_complete_wr(struct stream_connect_ctx *ctx, struct ibv_wc *wc) {
+	uint32_t index = STREAM_WRID_INDEX(wc->wr_id);
+	struct stream_buffer *sbuf;
+
+	switch (STREAM_WRID_TYPE(wc->wr_id)) {
+	case STREAM_SEND_WRID:
+	case STREAM_CREDIT_WRID:
+		sbuf = &ctx->send_buf;
+		break;
+	case STREAM_RECV_WRID:
+		sbuf = &ctx->recv_buf;
+		break;
+	default:
+		return NULL;
+	}
+
+	stream_buffer_release(sbuf, index);
+	return sbuf->bufs[index];
+}
+
+int stream_shutdown(struct stream_connect_ctx *ctx) {
+	struct ibv_send_wr *bad_wr = NULL;
+	struct ibv_recv_wr *bad_recv_wr = NULL;
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_ERR,
 	};
+	// no data, they only have to come back after everything posted before
 	struct ibv_send_wr wr = {
-		.wr_id = STREAM_SEND_WRID,
-		.sg_list = &list,
-		.num_sge = 1,
+		.wr_id = STREAM_WRID(STREAM_DRAIN_WRID, 0),
 		.opcode = IBV_WR_SEND,
 		.send_flags = IBV_SEND_SIGNALED,
 	};
-	struct ibv_send_wr *bad_wr;
+	struct ibv_recv_wr recv_wr = {
+		.wr_id = STREAM_WRID(STREAM_DRAIN_WRID, 0),
+	};
 
-	retries = MAX_RETRIES;
-	do {
-		err = ibv_post_send(ctx->qp, &wr, &bad_wr);
-	} while(err && --retries);
+	if (ctx->draining) {
+		return 0;
+	}
+
+	if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
+		fprintf(stderr, "Failed to modify QP to ERR\n");
+		return 1;
+	}
+
+	if (ibv_post_send(ctx->qp, &wr, &bad_wr)) {
+		fprintf(stderr, "Couldn't post drain marker\n");
+		return 1;
+	}
+	ctx->draining++;
 
-	return err;
+	// receives from a shared queue only complete for the QP once it took
+	// them, there is nothing of its own to wait for
+	if (!ctx->srq) {
+		if (ibv_post_recv(ctx->qp, &recv_wr, &bad_recv_wr)) {
+			fprintf(stderr, "Couldn't post drain marker\n");
+			return 1;
+		}
+		ctx->draining++;
+	}
+
+	return 0;
 }
 
 struct stream_connect_ctx * stream_process_connect_request(struct stream_connect_cfg *cfg, struct stream_dest *dest) {
@@ -360,7 +794,8 @@ struct stream_connect_ctx * stream_process_connect_request(struct stream_connect
   struct stream_connect_ctx *ctx;
   ctx = calloc(1, sizeof *ctx);
   if (!ctx) {
-    goto error;
+    free(dest);
+    return NULL;
   }
   ctx->rem_dest = dest;
 
@@ -423,3 +858,28 @@ void gid_to_wire_gid(const union ibv_gid *gid, char wgid[]) {
 	for (i = 0; i < 4; ++i)
 		sprintf(&wgid[i * 8], "%08x", htonl(*(uint32_t *)(gid->raw + i * 4)));
 }
+
+void stream_connect_message_to_wire(const struct stream_connect_message *msg, char *wire) {
+	char gid[33];
+
+	gid_to_wire_gid(&msg->dest.gid, gid);
+	sprintf(wire, "%04x:%06x:%06x:%04x:%08x:%02x:%02x:%x:%02x:%s", msg->dest.lid,
+			msg->dest.qpn, msg->dest.psn, msg->credit, (uint32_t) msg->connect_id,
+			msg->lane, msg->no_lanes, msg->merge ? 1 : 0, msg->rail, gid);
+}
+
+void wire_to_stream_connect_message(const char *wire, struct stream_connect_message *msg) {
+	char gid[33];
+	unsigned int credit, connect_id, lane, no_lanes, merge, rail;
+
+	memset(msg, 0, sizeof *msg);
+	sscanf(wire, "%x:%x:%x:%x:%x:%x:%x:%x:%x:%s", &msg->dest.lid, &msg->dest.qpn,
+			&msg->dest.psn, &credit, &connect_id, &lane, &no_lanes, &merge, &rail, gid);
+	msg->credit = credit;
+	msg->connect_id = connect_id;
+	msg->lane = lane;
+	msg->no_lanes = no_lanes;
+	msg->merge = merge;
+	msg->rail = rail;
+	wire_gid_to_gid(gid, &msg->dest.gid);
+}
@@ -5,52 +5,208 @@
 #include <infiniband/verbs.h>
 
 #include "message.h"
+#include "buffer.h"
+#include "device.h"
+#include "srq.h"
+#include "spin.h"
+#include "submit.h"
 
 #define MAX_RETRIES    1
+// alignment of each message buffer inside the registered region
+#define STREAM_BUF_ALIGN 64
+// no of completions retired per poll by default, and at most
+#define STREAM_POLL_BATCH 16
+#define STREAM_POLL_BATCH_MAX 64
+// queued messages posted as one chain at most
+#define STREAM_SUBMIT_BATCH 64
+// completion events acknowledged at a time, an ack takes a lock in the library
+#define STREAM_CQ_ACK_BATCH 64
 
 enum {
 	STREAM_RECV_WRID = 1,
 	STREAM_SEND_WRID = 2,
+	// send of a standalone credit update
+	STREAM_CREDIT_WRID = 4,
+	// receive posted to the shared receive queue, the index is into its pool
+	STREAM_SRQ_WRID = 8,
+	// marker posted behind everything else when a connection shuts down
+	STREAM_DRAIN_WRID = 16,
 };
 
-struct stream_buffer {
-	// set of buffers to hold the messages
-	uint8_t **bufs;
-	// set of send buffers
-	// current index of the buffer
-	uint16_t index;
-	// no of buffers allocated
-	uint16_t size;
+/**
+ * The work request id carries the type in the lower half and the buffer index
+ * in the upper half, so a completion maps straight to its buffer.
+ */
+#define STREAM_WRID(type, index) (((uint64_t) (index) << 32) | (type))
+#define STREAM_WRID_TYPE(wr_id)  ((uint32_t) ((wr_id) & 0xffffffff))
+#define STREAM_WRID_INDEX(wr_id) ((uint32_t) ((wr_id) >> 32))
+
+/**
+ * Life cycle of a connection
+ */
+enum stream_state {
+	STREAM_CONNECTED = 0,
+	// the peer sent a close, everything before it has been delivered
+	STREAM_CLOSED,
+	// a work request failed, the queue pair is unusable
+	STREAM_ERROR,
 };
 
+struct stream_connect_ctx;
+
+/**
+ * Called for every message received on a connection. The data points into the
+ * receive buffer and is only valid during the call. A non zero return closes
+ * the connection with an error.
+ */
+typedef int (*stream_msg_handler)(struct stream_connect_ctx *ctx,
+		struct stream_message *msg, void *arg);
+
+/**
+ * Called once a connection driven by a poller or an event loop is done, before
+ * it is closed
+ */
+typedef void (*stream_close_handler)(struct stream_connect_ctx *ctx, void *arg);
+
+/**
+ * Count a completion event taken from a channel and acknowledge them once a
+ * batch has built up. The rest are acknowledged before the CQ is destroyed.
+ */
+static inline void stream_count_cq_event(struct ibv_cq *cq, unsigned int *num_events) {
+	if (++*num_events >= STREAM_CQ_ACK_BATCH) {
+		ibv_ack_cq_events(cq, *num_events);
+		*num_events = 0;
+	}
+}
+
+struct stream_lanes;
+
 /**
  * Keep track of the objects created for a connection.
  */
 struct stream_connect_ctx {
+	// shared device, context and pd are borrowed from it
+	struct stream_device *dev;
 	struct ibv_context *context;
 	struct ibv_comp_channel *channel;
 	struct ibv_pd *pd;
+	// registered memory holding both the send and receive buffers, buf and
+	// mr are borrowed from it
+	struct stream_mem *mem;
 	struct ibv_mr *mr;
 	struct ibv_cq *cq;
+	// the completion queue belongs to the device and is polled for all
+	// its connections
+	int shared_cq;
+	// completion vector of the queue, the shard with a shared queue
+	int comp_vector;
 	struct ibv_qp *qp;
 	void *buf;
+	// size of a single message buffer
 	int size;
 	int	rx_depth;
-	int	pending;
+	int	tx_depth;
+	// receives are replenished once this few are left posted
+	int	rx_watermark;
+	// shared receive queue of the device, NULL when the QP has its own
+	struct stream_srq *srq;
+	// chain of receive requests reused for every refill
+	struct ibv_recv_wr *recv_wrs;
+	struct ibv_sge *recv_sges;
+	// received messages waiting for the application, oldest at the ring tail
+	int	recv_ready;
+	// messages taken by handlers elsewhere and not given back yet, they sit
+	// at the ring tail ahead of the ready ones
+	int recv_held;
+	// id of the connection given by its poller
+	uint32_t id;
+	// where received messages are delivered
+	stream_msg_handler handler;
+	void *handler_arg;
+	enum stream_state state;
+	// drain markers posted once the QP is in error
+	int draining;
+	// drain markers completed, when all are back nothing more completes
+	// for the QP
+	int drained;
+	// done, with its last message back from a handler while the poller
+	// couldn't take it down, and the next one waiting for the same
+	int finish_pending;
+	struct stream_connect_ctx *finish_next;
+	// set by the async event thread once the QP of a connection on a shared
+	// receive queue takes no more receives from it
+	int last_wqe;
+	// drained, and waiting on the poller for last_wqe with the next one
+	int last_wqe_pending;
+	struct stream_connect_ctx *last_wqe_next;
+	// completion events not yet acknowledged
+	unsigned int num_cq_events;
+	// spin on the CQ while busy and only sleep on the channel once idle
+	int adaptive;
+	struct stream_spin spin;
+	// no of completions taken per poll
+	int poll_batch;
+	// last poll round of a shared CQ that had completions for the connection
+	uint64_t poll_round;
+	// chain of send requests reused for every batch
+	struct ibv_send_wr *send_wrs;
+	struct ibv_sge *send_sges;
 	struct ibv_port_attr portinfo;
-	// device list to keep around until freed at the end
-	struct ibv_device **dev_list;
-	// the device to use
-	struct ibv_device *device;
 	struct stream_dest self_dest;   // self destination
 	struct stream_dest *rem_dest;   // remote destination
 
-	// memory mapped buffers for sending
+	// receives posted by the peer that we are still allowed to send to
+	int credit;
+	// receives posted locally that the peer hasn't been told about yet
+	int credit_return;
+	// send a standalone credit update once credit_return reaches this
+	int credit_threshold;
+	// sequence number of the next message to send
+	uint64_t sequence;
+
+	// ask for a send completion every signal_interval sends
+	int signal_interval;
+	// sends posted since the last signaled one
+	int unsignaled;
+	// largest send the QP takes inline
+	uint32_t max_inline;
+	// messages queued by other threads, NULL if only the owner sends
+	struct stream_submit *submit;
+	// stream the connection is a lane of, see lanes.h
+	uint32_t connect_id;
+	int lane;
+	int no_lanes;
+	int merge;
+	int rail;
+	// sequence shared with the other lanes, NULL for the own one
+	uint64_t *shared_sequence;
+	// lanes received with this one, set by whoever groups them
+	struct stream_lanes *lanes;
+
+	// registered buffers for sending
 	struct stream_buffer send_buf;
-	// memory mapped buffers for receiving
+	// registered buffers for receiving, with a shared receive queue the ring
+	// only keeps the pool buffers in the order they arrived
 	struct stream_buffer recv_buf;
 };
 
+/**
+ * Pull the header of the buffer a receive completion refers to into the cache,
+ * so it is there by the time the completion is handled
+ */
+static inline void stream_prefetch_wc(struct stream_connect_ctx *ctx, struct ibv_wc *wc) {
+	uint32_t index = STREAM_WRID_INDEX(wc->wr_id);
+
+	switch (STREAM_WRID_TYPE(wc->wr_id)) {
+		case STREAM_RECV_WRID:
+			__builtin_prefetch(ctx->recv_buf.bufs[index]);
+			break;
+		case STREAM_SRQ_WRID:
+			__builtin_prefetch(stream_srq_buf(ctx->srq, index));
+			break;
+	}
+}
+
 /**
  * Stream configurations.
  */
@@ -62,10 +218,31 @@ struct stream_connect_cfg {
 	int size;             // size of the buffer
 	enum ibv_mtu mtu;
 	int rx_depth;         // receive depth
+	int tx_depth;         // no of sends outstanding at a time
+	int rx_watermark;     // refill receives when this many are left, 0 for rx_depth / 2
 	int use_event;
+	int adaptive;         // poll while busy, sleep on CQ events once idle
+	int spin_budget;      // empty polls before sleeping in adaptive mode, 0 to tune it
+	int poll_batch;       // completions taken per poll, up to STREAM_POLL_BATCH_MAX
 	int sl;               // service level value
 	int gidx;             // gid value
 	int page_size;        // page size
+	int credit_threshold; // returned credit backlog forcing a credit update, 0 for rx_depth / 2
+	int signal_interval;  // signal every nth send, 1 signals all
+	int max_inline;       // largest message to send inline, the device may allow less
+	int srq_depth;        // buffers in the receive queue shared by the connections, 0 for none
+	int srq_limit;        // refill the shared receive queue below this, 0 for srq_depth / 4
+	int handler_threads;  // threads per poller running the message handlers, 0 runs them inline
+	int submit_depth;     // messages other threads may queue on a connection, 0 for none
+	uint32_t connect_id;  // stream the connection belongs to when it is one of several lanes
+	int lane;             // lane of the connection in the stream
+	int no_lanes;         // lanes of the stream, 0 for a plain connection
+	int merge;            // lanes share one sequence and the receiver merges them
+	int rail;             // rail of the receiver the connection goes over, see stream_rail
+	int shared_cq;        // use the completion queue of the device instead of one per connection
+	int event_threads;    // threads sleeping on the completion channels with epoll, 0 for none
+	int shards;           // pollers on the device, each with its own shared completion queue
+	int comp_vector;      // completion vector of the CQ, the shard to join with shared_cq
 };
 
 /**
@@ -82,7 +259,8 @@ struct stream_connect_req {
 void stream_init_cfg(struct stream_connect_cfg *cfg);
 
 /**
- * Get the requested device according to configuration.
+ * Take a reference on the requested device according to configuration. The
+ * device is shared with the other connections on it.
  */
 int stream_assign_device(struct stream_connect_cfg *cfg, struct stream_connect_ctx *ctx);
 
@@ -97,14 +275,98 @@ int stream_connect_ctx(struct stream_connect_cfg *cfg, struct stream_connect_ctx
 int stream_init_ctx(struct stream_connect_cfg *cfg, struct stream_connect_ctx *ctx);
 
 /**
- * Process a connect request from a client
+ * Stop the connection and flush its outstanding requests. Drain markers go
+ * behind the posted sends and receives, once ctx->drained reaches
+ * ctx->draining the connection can be closed without leaving completions for
+ * it on a shared completion queue. A QP on a shared receive queue also waits
+ * for ctx->last_wqe.
+ */
+int stream_shutdown(struct stream_connect_ctx *ctx);
+
+/**
+ * Process a connect request from a client. The context takes dest over, it is
+ * freed with the context, or right away on failure.
  */
 struct stream_connect_ctx * stream_process_connect_request(struct stream_connect_cfg *cfg, struct stream_dest *dest);
 
+/**
+ * Post up to n receives as one chained request. Returns the number posted.
+ */
 int stream_post_recv(struct stream_connect_ctx *ctx, int n);
 int stream_post_recv_single(struct stream_connect_ctx *ctx);
+
+/**
+ * Give back the received buffer at index, the oldest one held. A shared buffer
+ * goes back to the pool and its credit to the peer.
+ */
+void stream_release_recv(struct stream_connect_ctx *ctx, uint32_t index);
 int stream_post_send(struct stream_connect_ctx *ctx);
 
+/**
+ * Decide whether the next send asks for a completion. One completion retires
+ * every unsignaled send before it.
+ */
+int stream_send_signaled(struct stream_connect_ctx *ctx, int force);
+
+/**
+ * Fill the next send buffer with a message and build its work request. data is
+ * copied after the header unless NULL. Takes a credit and piggybacks the credit
+ * owed to the peer. Returns the buffer index, -1 if no buffer is free.
+ */
+int stream_prepare_send(struct stream_connect_ctx *ctx, uint8_t type,
+		const void *data, uint64_t length, struct ibv_send_wr *wr, struct ibv_sge *sge);
+
+/**
+ * stream_prepare_send for one segment of a larger message, part counts the
+ * segments still to come after it
+ */
+int stream_prepare_part(struct stream_connect_ctx *ctx, uint8_t type, uint16_t part,
+		const void *data, uint64_t length, struct ibv_send_wr *wr, struct ibv_sge *sge);
+
+/**
+ * Undo the last stream_prepare_send for a request that was not posted
+ */
+void stream_cancel_send(struct stream_connect_ctx *ctx, struct ibv_send_wr *wr);
+
+/**
+ * Link n prepared requests and post them with a single doorbell. Only the last
+ * one may be signaled. Requests that fail to post are cancelled.
+ */
+int stream_post_send_chain(struct stream_connect_ctx *ctx, struct ibv_send_wr *wrs, int n,
+		int signal);
+
+/**
+ * No of data messages that can be sent now, limited by free buffers and credits
+ */
+int stream_send_window(struct stream_connect_ctx *ctx);
+
+/**
+ * Keep the send window full: post up to n messages while send buffers and
+ * credits last. Returns the number posted, -1 on error.
+ */
+int stream_post_window(struct stream_connect_ctx *ctx, int n);
+
+/**
+ * Send a standalone credit update if the returned credit backlog reached the threshold
+ */
+int stream_post_credit(struct stream_connect_ctx *ctx);
+
+/**
+ * Hand out the credit for receives posted since the last time the peer was told
+ */
+uint16_t stream_take_credit(struct stream_connect_ctx *ctx);
+
+/**
+ * Read the header of a received message and collect the credit it carries.
+ * Returns the message type.
+ */
+int stream_process_recv(struct stream_connect_ctx *ctx, uint8_t *buf, struct stream_message *msg);
+
+/**
+ * Give the buffer of a completed work request back to its ring
+ */
+uint8_t *stream_complete_wr(struct stream_connect_ctx *ctx, struct ibv_wc *wc);
+
 int stream_close_ctx(struct stream_connect_ctx *ctx);
 
 /**
@@ -114,6 +376,11 @@ int stream_server_connect(struct stream_connect_ctx *ctx, struct stream_connect_
 		const struct stream_dest *self_dest);
 
 
+/**
+ * Completions to take per poll, the configured batch within its bounds
+ */
+int stream_poll_batch(struct stream_connect_cfg *cfg);
+
 enum ibv_mtu stream_mtu_to_enum(int mtu);
 uint16_t stream_get_local_lid(struct ibv_context *context, int port);
 int stream_get_port_info(struct ibv_context *context, int port,
@@ -121,4 +388,12 @@ int stream_get_port_info(struct ibv_context *context, int port,
 void wire_gid_to_gid(const char *wgid, union ibv_gid *gid);
 void gid_to_wire_gid(const union ibv_gid *gid, char wgid[]);
 
+/**
+ * Connect message as exchanged over TCP: lid, qpn, psn, credit, stream id,
+ * lane, no of lanes, merge, rail and gid
+ */
+#define STREAM_WIRE_CONNECT_SIZE (sizeof "0000:000000:000000:0000:00000000:00:00:0:00:00000000000000000000000000000000")
+void stream_connect_message_to_wire(const struct stream_connect_message *msg, char *wire);
+void wire_to_stream_connect_message(const char *wire, struct stream_connect_message *msg);
+
 #endif /* IBV_STREAM_H */
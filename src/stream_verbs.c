@@ -1,4 +1,97 @@
-#include "stream.h"
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "lanes.h"
+#include "stream_verbs.h"
+
+/**
+ * Exchange the connect messages with the server over TCP
+ */
+static struct stream_dest *stream_client_exch_dest(const char *servername, int port,
+						 struct stream_connect_ctx *ctx) {
+	struct addrinfo *res, *t;
+	struct addrinfo hints = {
+		.ai_family   = AF_INET,
+		.ai_socktype = SOCK_STREAM
+	};
+	char *service;
+	char msg[STREAM_WIRE_CONNECT_SIZE];
+	int n;
+	int sockfd = -1;
+	struct stream_dest *rem_dest = NULL;
+	struct stream_connect_message conn_msg;
+
+	if (asprintf(&service, "%d", port) < 0)
+		return NULL;
+
+	n = getaddrinfo(servername, service, &hints, &res);
+
+	if (n < 0) {
+		fprintf(stderr, "%s for %s:%d\n", gai_strerror(n), servername, port);
+		free(service);
+		return NULL;
+	}
+
+	for (t = res; t; t = t->ai_next) {
+		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+		if (sockfd >= 0) {
+			if (!connect(sockfd, t->ai_addr, t->ai_addrlen))
+				break;
+			close(sockfd);
+			sockfd = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+	free(service);
+
+	if (sockfd < 0) {
+		fprintf(stderr, "Couldn't connect to %s:%d\n", servername, port);
+		return NULL;
+	}
+
+	memset(&conn_msg, 0, sizeof conn_msg);
+	conn_msg.dest = ctx->self_dest;
+	conn_msg.credit = stream_take_credit(ctx);
+	conn_msg.connect_id = ctx->connect_id;
+	conn_msg.lane = ctx->lane;
+	conn_msg.no_lanes = ctx->no_lanes;
+	conn_msg.merge = ctx->merge;
+	conn_msg.rail = ctx->rail;
+	stream_connect_message_to_wire(&conn_msg, msg);
+	if (write(sockfd, msg, sizeof msg) != sizeof msg) {
+		fprintf(stderr, "Couldn't send local address\n");
+		goto out;
+	}
+
+	if (read(sockfd, msg, sizeof msg) != sizeof msg) {
+		perror("client read");
+		fprintf(stderr, "Couldn't read remote address\n");
+		goto out;
+	}
+
+	write(sockfd, "done", sizeof "done");
+
+	rem_dest = malloc(sizeof *rem_dest);
+	if (!rem_dest)
+		goto out;
+
+	wire_to_stream_connect_message(msg, &conn_msg);
+	*rem_dest = conn_msg.dest;
+	ctx->credit = conn_msg.credit;
+
+out:
+	close(sockfd);
+	return rem_dest;
+}
 
 /**
  * Create a single connection using a connection message
@@ -6,26 +99,633 @@
 struct stream_connect_ctx * stream_create_connection(
 		struct stream_connect_cfg *cfg,
 		struct stream_connect_message *conn_msg) {
+	struct stream_connect_ctx *ctx;
+	struct stream_dest *rem_dest;
 
+	rem_dest = malloc(sizeof *rem_dest);
+	if (!rem_dest) {
+		return NULL;
+	}
+	*rem_dest = conn_msg->dest;
+
+	// rem_dest is freed with the context, or by the call if it fails
+	ctx = stream_process_connect_request(cfg, rem_dest);
+	if (!ctx) {
+		return NULL;
+	}
+
+	// the peer may send as soon as it hears back, so the receives go first.
+	// The shared receive queue is already filled, the peer gets its share.
+	if (ctx->srq) {
+		ctx->credit_return = ctx->rx_depth;
+	} else if (stream_post_recv(ctx, ctx->rx_depth) < ctx->rx_depth) {
+		fprintf(stderr, "Couldn't post receive\n");
+		stream_close_ctx(ctx);
+		return NULL;
+	}
+	ctx->credit = conn_msg->credit;
+	ctx->connect_id = conn_msg->connect_id;
+	ctx->lane = conn_msg->lane;
+	ctx->no_lanes = conn_msg->no_lanes;
+	ctx->merge = conn_msg->merge;
+	ctx->rail = conn_msg->rail;
+
+	return ctx;
 }
 
 /**
  * Connect to a remote
  */
-int stream_connect(struct stream_connect_cfg *cfg) {
-	return 0;
+struct stream_connect_ctx *stream_connect(struct stream_connect_cfg *cfg) {
+	struct stream_connect_ctx *ctx;
+
+	ctx = calloc(1, sizeof *ctx);
+	if (!ctx) {
+		return NULL;
+	}
+
+	if (stream_assign_device(cfg, ctx)) {
+		fprintf(stderr, "Failed to get infiniband device\n");
+		goto error;
+	}
+
+	if (stream_init_ctx(cfg, ctx)) {
+		fprintf(stderr, "Failed to initialize context\n");
+		goto error;
+	}
+
+	if (stream_post_recv(ctx, ctx->rx_depth) < ctx->rx_depth) {
+		fprintf(stderr, "Couldn't post receive\n");
+		goto error;
+	}
+
+	ctx->rem_dest = stream_client_exch_dest(cfg->servername, cfg->port, ctx);
+	if (!ctx->rem_dest) {
+		goto error;
+	}
+
+	if (stream_connect_ctx(cfg, ctx)) {
+		fprintf(stderr, "Couldn't connect to remote QP\n");
+		goto error;
+	}
+
+	return ctx;
+
+	error:
+	stream_close_ctx(ctx);
+	return NULL;
 }
 
 /**
  * Send message
  */
-int stream_send_msg(struct stream_connect_ctx *ctx, char *buf) {
+int stream_send_msg(struct stream_connect_ctx *ctx, const void *buf, uint64_t len) {
+	return stream_send_part(ctx, buf, len, 0);
+}
+
+int stream_send_part(struct stream_connect_ctx *ctx, const void *buf, uint64_t len,
+		uint16_t part) {
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+
+	if (len + STREAM_MESSAGE_OVERHEAD > (uint64_t) ctx->size) {
+		fprintf(stderr, "Message of %lu bytes doesn't fit a buffer of %d\n",
+				(unsigned long) len, ctx->size);
+		return 1;
+	}
+
+	if (stream_send_window(ctx) <= 0) {
+		return EAGAIN;
+	}
+
+	stream_prepare_part(ctx, STREAM_MESSAGE_DATA, part, buf, len, &wr, &sge);
+	return stream_post_send_chain(ctx, &wr, 1, 0) ? 1 : 0;
+}
+
+/**
+ * Queue a message for the owner of the connection
+ */
+int stream_submit(struct stream_connect_ctx *ctx, const void *buf, uint64_t len) {
+	int err;
+
+	if (!ctx->submit) {
+		fprintf(stderr, "Connection has no submission queue\n");
+		return 1;
+	}
+
+	err = stream_submit_push(ctx->submit, buf, len);
+	if (err == 1) {
+		fprintf(stderr, "Message of %lu bytes doesn't fit a buffer of %d\n",
+				(unsigned long) len, ctx->size);
+	}
+	return err;
+}
+
+/**
+ * Post what other threads queued, as many chains as the window allows
+ */
+static int stream_drain_submit(struct stream_connect_ctx *ctx) {
+	struct stream_message msgs[STREAM_SUBMIT_BATCH];
+	int n, sent;
+
+	while ((n = stream_submit_peek(ctx->submit, msgs,
+			MIN(STREAM_SUBMIT_BATCH, stream_send_window(ctx)))) > 0) {
+		sent = stream_send_batch(ctx, msgs, n);
+		if (sent < 0) {
+			return 1;
+		}
+		stream_submit_consume(ctx->submit, sent);
+		if (sent < n) {
+			break;
+		}
+	}
+
 	return 0;
 }
 
+/**
+ * Send a burst of messages with one doorbell
+ */
+int stream_send_batch(struct stream_connect_ctx *ctx, struct stream_message *msgs, int n) {
+	int i;
+
+	n = MIN(n, stream_send_window(ctx));
+	// a message that doesn't fit a buffer ends the batch
+	for (i = 0; i < n; ++i) {
+		if (msgs[i].length + STREAM_MESSAGE_OVERHEAD > (uint64_t) ctx->size) {
+			fprintf(stderr, "Message of %lu bytes doesn't fit a buffer of %d\n",
+					(unsigned long) msgs[i].length, ctx->size);
+			if (i == 0) {
+				return -1;
+			}
+			n = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		stream_prepare_send(ctx, STREAM_MESSAGE_DATA, msgs[i].buf, msgs[i].length,
+				&ctx->send_wrs[i], &ctx->send_sges[i]);
+	}
+
+	if (stream_post_send_chain(ctx, ctx->send_wrs, n, 1)) {
+		return -1;
+	}
+
+	return MAX(n, 0);
+}
+
+/**
+ * Ask for a completion covering every send posted so far
+ */
+int stream_flush(struct stream_connect_ctx *ctx) {
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+
+	if (!ctx->unsignaled) {
+		return 0;
+	}
+
+	// a signaled credit update retires everything queued before it
+	if (ctx->credit < 1 || stream_buffer_free_count(&ctx->send_buf) == 0) {
+		return EAGAIN;
+	}
+
+	stream_prepare_send(ctx, STREAM_MESSAGE_CREDIT, NULL, 0, &wr, &sge);
+	return stream_post_send_chain(ctx, &wr, 1, 1) ? 1 : 0;
+}
+
+/**
+ * Tell the peer no more messages follow
+ */
+int stream_disconnect(struct stream_connect_ctx *ctx) {
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+
+	if (ctx->credit < 1 || stream_buffer_free_count(&ctx->send_buf) == 0) {
+		return EAGAIN;
+	}
+
+	// signaled, so its completion retires every send before it
+	stream_prepare_send(ctx, STREAM_MESSAGE_CLOSE, NULL, 0, &wr, &sge);
+	return stream_post_send_chain(ctx, &wr, 1, 1) ? 1 : 0;
+}
+
+/**
+ * Give back received control messages sitting at the head of the receive
+ * queue, they hold a buffer but have nothing for the application. A close
+ * from the peer ends the connection.
+ */
+static void stream_skip_control(struct stream_connect_ctx *ctx) {
+	struct stream_message msg;
+	uint32_t index;
+
+	// behind held messages a control message waits its turn to be taken
+	while (ctx->recv_ready > 0 && ctx->recv_held == 0) {
+		index = ctx->recv_buf.tail;
+		stream_data_message_header_from_buffer(ctx->recv_buf.bufs[index], &msg);
+		if (msg.type == STREAM_MESSAGE_DATA) {
+			break;
+		} else if (msg.type == STREAM_MESSAGE_CLOSE && ctx->state == STREAM_CONNECTED) {
+			ctx->state = STREAM_CLOSED;
+		}
+		stream_release_recv(ctx, index);
+		ctx->recv_ready--;
+	}
+}
+
+/**
+ * Post receives once the posted ones drop to the watermark and return credit
+ */
+static int stream_replenish(struct stream_connect_ctx *ctx) {
+	int posted = ctx->recv_buf.used - ctx->recv_ready - ctx->recv_held;
+
+	int n = stream_buffer_free_count(&ctx->recv_buf);
+
+	// the shared queue refills itself, credit goes back as buffers are released
+	if (!ctx->srq && posted <= ctx->rx_watermark && n > 0) {
+		if (stream_post_recv(ctx, n) < n) {
+			fprintf(stderr, "Couldn't post receive\n");
+			return 1;
+		}
+	}
+
+	return stream_post_credit(ctx);
+}
+
+/**
+ * Mark where a message received on a merged lane falls in the stream
+ */
+static int stream_note_recv(struct stream_connect_ctx *ctx, struct stream_message *msg) {
+	if (msg->type != STREAM_MESSAGE_DATA || !ctx->lanes || !ctx->lanes->merge) {
+		return 0;
+	}
+
+	if (stream_lanes_arrived(ctx->lanes, ctx->lane, msg->sequence)) {
+		ctx->state = STREAM_ERROR;
+		return 1;
+	}
+	return 0;
+}
+
+int stream_handle_wc(struct stream_connect_ctx *ctx, struct ibv_wc *wc) {
+	struct stream_message msg;
+	uint8_t *buf;
+	int index;
+
+	// everything posted before the marker has completed
+	if (STREAM_WRID_TYPE(wc->wr_id) == STREAM_DRAIN_WRID) {
+		ctx->drained++;
+		return 0;
+	}
+
+	if (wc->status != IBV_WC_SUCCESS) {
+		// a flushed shared receive still owns a pool buffer
+		if (STREAM_WRID_TYPE(wc->wr_id) == STREAM_SRQ_WRID) {
+			stream_srq_release(ctx->srq, stream_srq_received(ctx->srq,
+					STREAM_WRID_INDEX(wc->wr_id)));
+		}
+
+		// the rest of the queue is flushed after the first failure, or
+		// after a shutdown of a connection that is done
+		if (ctx->state == STREAM_CONNECTED) {
+			fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+					ibv_wc_status_str(wc->status),
+					wc->status, STREAM_WRID_TYPE(wc->wr_id));
+			ctx->state = STREAM_ERROR;
+		}
+		return 1;
+	}
+
+	switch (STREAM_WRID_TYPE(wc->wr_id)) {
+	case STREAM_SEND_WRID:
+	case STREAM_CREDIT_WRID:
+		stream_complete_wr(ctx, wc);
+		break;
+
+	case STREAM_RECV_WRID:
+		// receives complete in order, the buffer stays with the message
+		// until the application takes it
+		stream_process_recv(ctx, ctx->recv_buf.bufs[STREAM_WRID_INDEX(wc->wr_id)], &msg);
+		ctx->recv_ready++;
+		return stream_note_recv(ctx, &msg);
+
+	case STREAM_SRQ_WRID:
+		// shared buffers come back in any order, the ring keeps them in
+		// the order the messages arrived on this connection
+		buf = stream_srq_received(ctx->srq, STREAM_WRID_INDEX(wc->wr_id));
+		index = stream_buffer_acquire(&ctx->recv_buf);
+		if (index < 0) {
+			fprintf(stderr, "Peer sent beyond its credit\n");
+			stream_srq_release(ctx->srq, buf);
+			ctx->state = STREAM_ERROR;
+			return 1;
+		}
+		ctx->recv_buf.bufs[index] = buf;
+		stream_process_recv(ctx, buf, &msg);
+		ctx->recv_ready++;
+		return stream_note_recv(ctx, &msg);
+
+	default:
+		fprintf(stderr, "Completion for unknown wr_id %d\n",
+				STREAM_WRID_TYPE(wc->wr_id));
+		ctx->state = STREAM_ERROR;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Drive the completion queue
+ */
+int stream_progress(struct stream_connect_ctx *ctx) {
+	struct ibv_wc wc[STREAM_POLL_BATCH_MAX];
+	int ne, i;
+
+	ne = ibv_poll_cq(ctx->cq, ctx->poll_batch, wc);
+	if (ne < 0) {
+		fprintf(stderr, "poll CQ failed %d\n", ne);
+		return -1;
+	}
+
+	for (i = 0; i < ne; ++i) {
+		// the next message is on its way into the cache while this one is handled
+		if (i + 1 < ne) {
+			stream_prefetch_wc(ctx, &wc[i + 1]);
+		}
+		if (stream_handle_wc(ctx, &wc[i])) {
+			return -1;
+		}
+	}
+
+	stream_skip_control(ctx);
+	if (stream_replenish(ctx)) {
+		return -1;
+	}
+
+	// the completions made room for queued messages
+	if (ctx->submit && stream_drain_submit(ctx)) {
+		return -1;
+	}
+
+	return ne;
+}
+
 /**
  * Receive message
  */
-int stream_recv_msg(struct stream_connect_ctx *ctx, char *buf) {
+int stream_recv_msg(struct stream_connect_ctx *ctx, void *buf, uint64_t *len) {
+	struct stream_message msg;
+	uint32_t index;
+
+	stream_skip_control(ctx);
+	if (ctx->recv_ready == 0) {
+		return EAGAIN;
+	}
+
+	index = ctx->recv_buf.tail;
+	stream_data_message_header_from_buffer(ctx->recv_buf.bufs[index], &msg);
+	if (msg.length > *len) {
+		fprintf(stderr, "Message of %lu bytes doesn't fit a buffer of %lu\n",
+				(unsigned long) msg.length, (unsigned long) *len);
+		return 1;
+	}
+
+	memcpy(buf, msg.buf, msg.length);
+	*len = msg.length;
+
+	stream_release_recv(ctx, index);
+	ctx->recv_ready--;
+
+	return stream_replenish(ctx);
+}
+
+/**
+ * Register where received messages go
+ */
+void stream_set_handler(struct stream_connect_ctx *ctx, stream_msg_handler handler, void *arg) {
+	ctx->handler = handler;
+	ctx->handler_arg = arg;
+}
+
+int stream_take_recv(struct stream_connect_ctx *ctx, struct stream_message *msg,
+		uint32_t *index) {
+	stream_skip_control(ctx);
+	if (ctx->recv_ready == 0) {
+		return 0;
+	}
+
+	*index = (ctx->recv_buf.tail + ctx->recv_held) % ctx->recv_buf.size;
+	stream_data_message_header_from_buffer(ctx->recv_buf.bufs[*index], msg);
+	if (msg->type == STREAM_MESSAGE_CLOSE && ctx->state == STREAM_CONNECTED) {
+		ctx->state = STREAM_CLOSED;
+	}
+
+	ctx->recv_ready--;
+	ctx->recv_held++;
+	return 1;
+}
+
+int stream_return_recv(struct stream_connect_ctx *ctx, uint32_t index) {
+	stream_release_recv(ctx, index);
+	ctx->recv_held--;
+	return stream_replenish(ctx);
+}
+
+/**
+ * Deliver every received message to the handler
+ */
+int stream_dispatch(struct stream_connect_ctx *ctx) {
+	struct stream_message msg;
+	uint32_t index;
+
+	// the stream delivers the messages of merged lanes in its own order
+	if (ctx->lanes && ctx->lanes->merge) {
+		stream_skip_control(ctx);
+		return stream_replenish(ctx);
+	}
+
+	while (ctx->recv_ready > 0 && ctx->state == STREAM_CONNECTED) {
+		stream_skip_control(ctx);
+		if (ctx->recv_ready == 0) {
+			break;
+		}
+
+		index = ctx->recv_buf.tail;
+		if (ctx->recv_ready > 1) {
+			__builtin_prefetch(ctx->recv_buf.bufs[(index + 1) % ctx->recv_buf.size]);
+		}
+		stream_data_message_header_from_buffer(ctx->recv_buf.bufs[index], &msg);
+		if (ctx->handler && ctx->handler(ctx, &msg, ctx->handler_arg)) {
+			ctx->state = STREAM_ERROR;
+			return 1;
+		}
+
+		stream_release_recv(ctx, index);
+		ctx->recv_ready--;
+	}
+
+	// a close right after the last message ends the connection
+	stream_skip_control(ctx);
+	return stream_replenish(ctx);
+}
+
+int stream_deliver_next(struct stream_connect_ctx *ctx) {
+	struct stream_message msg;
+	uint32_t index;
+
+	stream_skip_control(ctx);
+	if (ctx->recv_ready == 0) {
+		fprintf(stderr, "No message received to deliver\n");
+		ctx->state = STREAM_ERROR;
+		return 1;
+	}
+
+	index = ctx->recv_buf.tail;
+	stream_data_message_header_from_buffer(ctx->recv_buf.bufs[index], &msg);
+	if (ctx->handler && ctx->handler(ctx, &msg, ctx->handler_arg)) {
+		ctx->state = STREAM_ERROR;
+		return 1;
+	}
+
+	stream_release_recv(ctx, index);
+	ctx->recv_ready--;
+	return 0;
+}
+
+/**
+ * Sleep on the completion channel, and on the submission queue while there is
+ * room to post what comes in. Returns 1 for a CQ event, 0 if only messages
+ * were queued, -1 on error.
+ */
+static int stream_sleep(struct stream_connect_ctx *ctx) {
+	struct ibv_cq *ev_cq;
+	void          *ev_ctx;
+	struct pollfd pfds[2];
+
+	if (ctx->submit && stream_send_window(ctx) > 0) {
+		if (stream_submit_sleep(ctx->submit)) {
+			return 0;
+		}
+
+		pfds[0].fd = ctx->channel->fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = ctx->submit->wake_fd;
+		pfds[1].events = POLLIN;
+		while (poll(pfds, 2, -1) < 0) {
+			if (errno != EINTR) {
+				perror("poll");
+				stream_submit_woke(ctx->submit);
+				return -1;
+			}
+		}
+		stream_submit_woke(ctx->submit);
+
+		if (!(pfds[0].revents & POLLIN)) {
+			return 0;
+		}
+	}
+
+	if (ibv_get_cq_event(ctx->channel, &ev_cq, &ev_ctx)) {
+		fprintf(stderr, "Failed to get cq_event\n");
+		return -1;
+	}
+
+	stream_count_cq_event(ctx->cq, &ctx->num_cq_events);
+
+	if (ev_cq != ctx->cq) {
+		fprintf(stderr, "CQ event for unknown CQ %p\n", ev_cq);
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+ * Block until the completion queue has something
+ */
+int stream_wait(struct stream_connect_ctx *ctx) {
+	int ev;
+
+	ev = stream_sleep(ctx);
+	if (ev <= 0) {
+		// woken for queued messages, the notification is still armed
+		return ev < 0;
+	}
+
+	if (ibv_req_notify_cq(ctx->cq, 0)) {
+		fprintf(stderr, "Couldn't request CQ notification\n");
+		return 1;
+	}
+
 	return 0;
 }
+
+/**
+ * Spin until the budget runs out, then sleep until the CQ has something
+ */
+int stream_idle(struct stream_connect_ctx *ctx, int ne) {
+	uint64_t start;
+	int ev;
+
+	if (!ctx->channel) {
+		return 0;
+	}
+
+	if (!ctx->adaptive) {
+		return ne == 0 ? stream_wait(ctx) : 0;
+	}
+
+	if (!stream_spin_idle(&ctx->spin, ne)) {
+		return 0;
+	}
+
+	if (ibv_req_notify_cq(ctx->cq, 0)) {
+		fprintf(stderr, "Couldn't request CQ notification\n");
+		return 1;
+	}
+
+	// a completion that came in before the notify was armed raises no
+	// event, poll once more before going to sleep
+	ne = stream_progress(ctx);
+	if (ne != 0) {
+		stream_spin_missed(&ctx->spin);
+		return ne < 0;
+	}
+
+	start = stream_spin_now();
+	ev = stream_sleep(ctx);
+	if (ev < 0) {
+		return 1;
+	}
+
+	if (ev == 0) {
+		// the notification stays armed, its event says nothing about the budget
+		stream_spin_missed(&ctx->spin);
+	} else {
+		stream_spin_woke(&ctx->spin, stream_spin_now() - start);
+	}
+
+	return 0;
+}
+
+/**
+ * Stream until the peer closes or the connection fails
+ */
+int stream_run(struct stream_connect_ctx *ctx) {
+	int ne;
+
+	while (ctx->state == STREAM_CONNECTED) {
+		ne = stream_progress(ctx);
+		if (ne < 0 || stream_dispatch(ctx)) {
+			break;
+		}
+
+		if (ctx->state == STREAM_CONNECTED && stream_idle(ctx, ne)) {
+			ctx->state = STREAM_ERROR;
+		}
+	}
+
+	return ctx->state == STREAM_CLOSED ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+#ifndef IBV_STREAM_VERBS_H
+#define IBV_STREAM_VERBS_H
+
+#include "stream.h"
+
+/**
+ * Non blocking message API on top of a stream context. Nothing here waits:
+ * sends return EAGAIN when the window or the peer's credits are used up and
+ * receives return EAGAIN when no message is ready. stream_progress drives the
+ * completion queue and has to be called for either to move.
+ */
+
+/**
+ * Create a single connection using a connection message. This is done in the
+ * server once the client's connect message is read.
+ */
+struct stream_connect_ctx * stream_create_connection(
+		struct stream_connect_cfg *cfg,
+		struct stream_connect_message *conn_msg);
+
+/**
+ * Connect to the server at cfg->servername
+ */
+struct stream_connect_ctx *stream_connect(struct stream_connect_cfg *cfg);
+
+/**
+ * Send message. Returns 0 when posted, EAGAIN when no buffer or credit is
+ * available, 1 on error.
+ */
+int stream_send_msg(struct stream_connect_ctx *ctx, const void *buf, uint64_t len);
+
+/**
+ * Send one segment of a larger message, part counts the segments still to
+ * come after it. Returns like stream_send_msg.
+ */
+int stream_send_part(struct stream_connect_ctx *ctx, const void *buf, uint64_t len,
+		uint16_t part);
+
+/**
+ * Queue a copy of a message for the thread driving the connection, from any
+ * thread and without a lock. The driving thread posts queued messages in
+ * chains from stream_progress, and wakes from stream_wait or stream_idle for
+ * them. Needs cfg->submit_depth. Returns 0 when queued, EAGAIN when the queue
+ * is full, 1 on error.
+ */
+int stream_submit(struct stream_connect_ctx *ctx, const void *buf, uint64_t len);
+
+/**
+ * Send a burst of messages as one chain of work requests with a single
+ * doorbell. Returns the number of messages posted, which is less than n when
+ * send buffers or credits run out, -1 on error.
+ */
+int stream_send_batch(struct stream_connect_ctx *ctx, struct stream_message *msgs, int n);
+
+/**
+ * Ask for a completion covering every send posted so far, so the send buffers
+ * drain even if no more messages follow. Returns EAGAIN if it can't be sent yet.
+ */
+int stream_flush(struct stream_connect_ctx *ctx);
+
+/**
+ * Receive message. len holds the size of buf and is set to the message length.
+ * Returns 0 when a message was copied, EAGAIN when none is ready, 1 on error.
+ */
+int stream_recv_msg(struct stream_connect_ctx *ctx, void *buf, uint64_t *len);
+
+/**
+ * Handle a single completion of the context
+ */
+int stream_handle_wc(struct stream_connect_ctx *ctx, struct ibv_wc *wc);
+
+/**
+ * Poll the completion queue once, retire sends, collect received messages and
+ * keep the receive queue full. Returns the number of completions, -1 on error.
+ */
+int stream_progress(struct stream_connect_ctx *ctx);
+
+/**
+ * Tell the peer no more messages follow. The close is signaled, so once the
+ * send buffers drain every message has been delivered.
+ */
+int stream_disconnect(struct stream_connect_ctx *ctx);
+
+/**
+ * Register the handler messages are delivered to by stream_dispatch
+ */
+void stream_set_handler(struct stream_connect_ctx *ctx, stream_msg_handler handler, void *arg);
+
+/**
+ * Deliver every received message to the handler and give the buffers back to
+ * the receive queue
+ */
+int stream_dispatch(struct stream_connect_ctx *ctx);
+
+/**
+ * Deliver only the oldest received message to the handler, for a stream that
+ * picks the order its lanes are delivered in. Receives are posted again by
+ * the next stream_dispatch. Returns 1 on failure.
+ */
+int stream_deliver_next(struct stream_connect_ctx *ctx);
+
+/**
+ * Take the next received message for a handler running on another thread,
+ * its buffer is held until it is returned. Messages are taken and returned in
+ * order, a control message is taken as well once messages are held before
+ * it. Returns 1 if a message was taken.
+ */
+int stream_take_recv(struct stream_connect_ctx *ctx, struct stream_message *msg,
+		uint32_t *index);
+
+/**
+ * Return the oldest taken message once its handler is done
+ */
+int stream_return_recv(struct stream_connect_ctx *ctx, uint32_t index);
+
+/**
+ * Block on the completion channel until the CQ has something, then re-arm it
+ */
+int stream_wait(struct stream_connect_ctx *ctx);
+
+/**
+ * Called after a poll that found ne completions. With a completion channel it
+ * sleeps when nothing came, or in adaptive mode once the spin budget is used
+ * up. Without a channel it returns at once.
+ */
+int stream_idle(struct stream_connect_ctx *ctx, int ne);
+
+/**
+ * Stream messages to the handler until the peer closes or the connection
+ * fails. Returns 0 on a clean close.
+ */
+int stream_run(struct stream_connect_ctx *ctx);
+
+#endif /* IBV_STREAM_VERBS_H */
@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "submit.h"
+
+int stream_submit_init(struct stream_submit *queue, uint32_t depth, uint32_t buf_size) {
+	uint32_t i, size = 1;
+
+	while (size < depth) {
+		size <<= 1;
+	}
+
+	queue->size = size;
+	queue->buf_size = buf_size;
+	queue->enqueue_pos = 0;
+	queue->dequeue_pos = 0;
+	queue->waiting = 0;
+	queue->data = NULL;
+
+	queue->cells = calloc(size, sizeof (struct stream_submit_cell));
+	if (!queue->cells) {
+		fprintf(stderr, "Couldn't allocate submission queue of %u\n", size);
+		return 1;
+	}
+
+	queue->data = malloc((size_t) size * buf_size);
+	if (!queue->data) {
+		fprintf(stderr, "Couldn't allocate submission buffers of %u\n", size);
+		goto error;
+	}
+
+	queue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->wake_fd < 0) {
+		perror("eventfd");
+		goto error;
+	}
+
+	for (i = 0; i < size; ++i) {
+		queue->cells[i].seq = i;
+	}
+
+	return 0;
+
+	error:
+	free(queue->data);
+	free(queue->cells);
+	queue->cells = NULL;
+	return 1;
+}
+
+void stream_submit_free(struct stream_submit *queue) {
+	if (!queue->cells) {
+		return;
+	}
+
+	close(queue->wake_fd);
+	free(queue->data);
+	free(queue->cells);
+	queue->cells = NULL;
+}
+
+int stream_submit_push(struct stream_submit *queue, const void *buf, uint64_t len) {
+	struct stream_submit_cell *cell;
+	uint32_t pos, seq;
+	uint64_t one = 1;
+	int32_t dif;
+
+	if (len > queue->buf_size) {
+		return 1;
+	}
+
+	pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue->cells[pos & (queue->size - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int32_t) (seq - pos);
+		if (dif == 0) {
+			// the slot is free, whoever moves the position first owns it
+			if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			// the consumer hasn't taken the message a lap behind yet
+			return EAGAIN;
+		} else {
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(queue->data + (size_t) (pos & (queue->size - 1)) * queue->buf_size, buf, len);
+	cell->length = len;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	// pairs with the fence in stream_submit_sleep, either the consumer sees
+	// the message or the producer sees it waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->waiting, __ATOMIC_RELAXED) &&
+			write(queue->wake_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+		perror("write");
+	}
+
+	return 0;
+}
+
+int stream_submit_peek(struct stream_submit *queue, struct stream_message *msgs, int max) {
+	struct stream_submit_cell *cell;
+	uint32_t pos = queue->dequeue_pos;
+	int n;
+
+	for (n = 0; n < max; ++n, ++pos) {
+		cell = &queue->cells[pos & (queue->size - 1)];
+		// filled in order of claiming, a slow producer holds up the ones after
+		if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			break;
+		}
+		msgs[n].buf = queue->data + (size_t) (pos & (queue->size - 1)) * queue->buf_size;
+		msgs[n].length = cell->length;
+	}
+
+	return n;
+}
+
+void stream_submit_consume(struct stream_submit *queue, int n) {
+	uint32_t pos = queue->dequeue_pos;
+	int i;
+
+	for (i = 0; i < n; ++i, ++pos) {
+		// free for the producers a lap ahead
+		__atomic_store_n(&queue->cells[pos & (queue->size - 1)].seq, pos + queue->size,
+				__ATOMIC_RELEASE);
+	}
+	queue->dequeue_pos = pos;
+}
+
+int stream_submit_sleep(struct stream_submit *queue) {
+	struct stream_submit_cell *cell = &queue->cells[queue->dequeue_pos & (queue->size - 1)];
+
+	__atomic_store_n(&queue->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == queue->dequeue_pos + 1) {
+		stream_submit_woke(queue);
+		return 1;
+	}
+	return 0;
+}
+
+void stream_submit_woke(struct stream_submit *queue) {
+	uint64_t count;
+
+	__atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+	// the wake ups are counted, clear them so the next sleep blocks
+	if (read(queue->wake_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+		perror("read");
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef IBV_SUBMIT_H
+#define IBV_SUBMIT_H
+
+#include <stdint.h>
+
+#include "message.h"
+
+/**
+ * A slot of the queue. Its sequence says whose turn it is: equal to the
+ * position a producer may fill it, one past it the consumer may take it.
+ */
+struct stream_submit_cell {
+	uint32_t seq;
+	uint32_t length;
+};
+
+/**
+ * Messages queued for a connection by any number of threads and taken by the
+ * one thread driving it. Producers claim a slot with a compare and swap and
+ * copy the message into it, nobody takes a lock. A producer wakes the driving
+ * thread through wake_fd if it announced it is going to sleep.
+ */
+struct stream_submit {
+	// next position to fill, shared by the producers
+	uint32_t enqueue_pos __attribute__((aligned(64)));
+	// next position to take, only the consumer moves it
+	uint32_t dequeue_pos __attribute__((aligned(64)));
+	// the consumer is about to sleep and wants to hear about new messages
+	int waiting __attribute__((aligned(64)));
+	int wake_fd;
+	uint32_t size;
+	uint32_t buf_size;
+	struct stream_submit_cell *cells;
+	uint8_t *data;
+};
+
+/**
+ * Create a queue of depth messages of up to buf_size bytes, depth is rounded
+ * up to a power of 2. Returns 1 on failure.
+ */
+int stream_submit_init(struct stream_submit *queue, uint32_t depth, uint32_t buf_size);
+
+void stream_submit_free(struct stream_submit *queue);
+
+/**
+ * Queue a copy of a message, from any thread. Returns 0 when queued, EAGAIN
+ * when the queue is full, 1 if the message doesn't fit a slot.
+ */
+int stream_submit_push(struct stream_submit *queue, const void *buf, uint64_t len);
+
+/**
+ * Point msgs at up to max queued messages in order, without taking them.
+ * Only from the consumer. Returns the number found.
+ */
+int stream_submit_peek(struct stream_submit *queue, struct stream_message *msgs, int max);
+
+/**
+ * Take the first n messages seen by stream_submit_peek, their slots go back
+ * to the producers
+ */
+void stream_submit_consume(struct stream_submit *queue, int n);
+
+/**
+ * The consumer is going to sleep on wake_fd as well. Returns 1 if messages came in since
+ * it last looked, then it shouldn't sleep.
+ */
+int stream_submit_sleep(struct stream_submit *queue);
+
+/**
+ * The consumer woke up, stop the producers from signaling
+ */
+void stream_submit_woke(struct stream_submit *queue);
+
+#endif /* IBV_SUBMIT_H */
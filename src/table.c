@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.h"
+
+// value left in a slot whose key was removed, lookups go on past it
+#define STREAM_TABLE_REMOVED ((void *) 1)
+
+/**
+ * Fibonacci hashing, spreads consecutive qp numbers over the table
+ */
+static inline uint32_t stream_table_slot(struct stream_table_slots *slots, uint32_t key) {
+	return (uint32_t) (key * 2654435769u) >> slots->shift;
+}
+
+/**
+ * Allocate empty slots with room for size keys at half load
+ */
+static struct stream_table_slots *stream_table_alloc(uint32_t size) {
+	struct stream_table_slots *slots;
+	uint32_t bits = 1;
+
+	// keep the table at most half full so probes stay short
+	while ((1u << bits) < size * 2) {
+		bits++;
+	}
+
+	slots = calloc(1, sizeof *slots + (sizeof (struct stream_table_entry) << bits));
+	if (!slots) {
+		fprintf(stderr, "Couldn't allocate table of %u\n", 1u << bits);
+		return NULL;
+	}
+
+	slots->size = 1u << bits;
+	slots->shift = 32 - bits;
+	return slots;
+}
+
+int stream_table_init(struct stream_table *table, uint32_t size) {
+	table->slots = stream_table_alloc(size);
+	if (!table->slots) {
+		return 1;
+	}
+
+	table->count = 0;
+	table->used = 0;
+	table->readers = 0;
+	pthread_mutex_init(&table->lock, NULL);
+	return 0;
+}
+
+/**
+ * Free the replaced slots once no lookup can be walking them. A lookup that
+ * starts now sees the current slots. The caller holds the lock.
+ */
+static void stream_table_reclaim(struct stream_table *table) {
+	struct stream_table_slots *slots = table->slots->retired;
+	struct stream_table_slots *retired;
+
+	if (!slots || __atomic_load_n(&table->readers, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	table->slots->retired = NULL;
+	while (slots) {
+		retired = slots->retired;
+		free(slots);
+		slots = retired;
+	}
+}
+
+void stream_table_free(struct stream_table *table) {
+	struct stream_table_slots *slots = table->slots;
+	struct stream_table_slots *retired;
+
+	while (slots) {
+		retired = slots->retired;
+		free(slots);
+		slots = retired;
+	}
+
+	table->slots = NULL;
+	table->count = 0;
+	table->used = 0;
+	pthread_mutex_destroy(&table->lock);
+}
+
+/**
+ * Copy the live keys into new slots with room for size keys and publish them.
+ * The caller holds the lock.
+ */
+static int stream_table_resize(struct stream_table *table, uint32_t size) {
+	struct stream_table_slots *old = table->slots;
+	struct stream_table_slots *slots;
+	uint32_t i, slot;
+
+	slots = stream_table_alloc(size);
+	if (!slots) {
+		return 1;
+	}
+
+	for (i = 0; i < old->size; ++i) {
+		void *value = old->entries[i].value;
+
+		if (!value || value == STREAM_TABLE_REMOVED) {
+			continue;
+		}
+		slot = stream_table_slot(slots, old->entries[i].key);
+		while (slots->entries[slot].value) {
+			slot = (slot + 1) & (slots->size - 1);
+		}
+		slots->entries[slot] = old->entries[i];
+	}
+
+	// lookups may still be walking the old slots
+	slots->retired = old;
+	__atomic_store_n(&table->slots, slots, __ATOMIC_SEQ_CST);
+	table->used = table->count;
+	stream_table_reclaim(table);
+	return 0;
+}
+
+int stream_table_insert(struct stream_table *table, uint32_t key, void *value) {
+	struct stream_table_slots *slots;
+	struct stream_table_entry *reuse = NULL;
+	uint32_t slot, i;
+	int ret = 1;
+
+	pthread_mutex_lock(&table->lock);
+	stream_table_reclaim(table);
+	slots = table->slots;
+	if (table->count * 2 >= slots->size) {
+		// grow
+		if (stream_table_resize(table, slots->size)) {
+			goto out;
+		}
+	} else if (table->used * 4 >= slots->size * 3) {
+		// removed slots make the probes long, clean them out
+		if (stream_table_resize(table, slots->size / 2)) {
+			goto out;
+		}
+	}
+	slots = table->slots;
+
+	slot = stream_table_slot(slots, key);
+	for (i = 0; i < slots->size; ++i) {
+		struct stream_table_entry *e = &slots->entries[slot];
+
+		if (!e->value) {
+			break;
+		}
+		if (e->value == STREAM_TABLE_REMOVED) {
+			if (!reuse) {
+				reuse = e;
+			}
+		} else if (e->key == key) {
+			goto out;
+		}
+		slot = (slot + 1) & (slots->size - 1);
+	}
+
+	if (!reuse) {
+		reuse = &slots->entries[slot];
+		table->used++;
+	}
+	// the key has to be in place before a lookup can see the value
+	__atomic_store_n(&reuse->key, key, __ATOMIC_RELAXED);
+	__atomic_store_n(&reuse->value, value, __ATOMIC_RELEASE);
+	table->count++;
+	ret = 0;
+
+	out:
+	pthread_mutex_unlock(&table->lock);
+	return ret;
+}
+
+/**
+ * Find the slot holding key in the given generation of slots
+ */
+static struct stream_table_entry *stream_table_find(struct stream_table_slots *slots,
+		uint32_t key, void **value) {
+	uint32_t slot, i;
+	void *v;
+
+	slot = stream_table_slot(slots, key);
+	for (i = 0; i < slots->size; ++i) {
+		struct stream_table_entry *e = &slots->entries[slot];
+
+		v = __atomic_load_n(&e->value, __ATOMIC_ACQUIRE);
+		if (!v) {
+			return NULL;
+		}
+		if (v != STREAM_TABLE_REMOVED && __atomic_load_n(&e->key, __ATOMIC_RELAXED) == key) {
+			// the slot may have been removed and taken by another key
+			// while the key was read, look at it again
+			if (__atomic_load_n(&e->value, __ATOMIC_ACQUIRE) != v) {
+				continue;
+			}
+			*value = v;
+			return e;
+		}
+		slot = (slot + 1) & (slots->size - 1);
+	}
+
+	return NULL;
+}
+
+void *stream_table_lookup(struct stream_table *table, uint32_t key) {
+	struct stream_table_slots *slots;
+	void *value = NULL;
+
+	// keeps the slots from being freed under us
+	__atomic_add_fetch(&table->readers, 1, __ATOMIC_SEQ_CST);
+	slots = __atomic_load_n(&table->slots, __ATOMIC_SEQ_CST);
+	stream_table_find(slots, key, &value);
+	__atomic_sub_fetch(&table->readers, 1, __ATOMIC_RELEASE);
+	return value;
+}
+
+void *stream_table_remove(struct stream_table *table, uint32_t key) {
+	struct stream_table_entry *e;
+	void *value = NULL;
+
+	pthread_mutex_lock(&table->lock);
+	e = stream_table_find(table->slots, key, &value);
+	if (e) {
+		__atomic_store_n(&e->value, STREAM_TABLE_REMOVED, __ATOMIC_RELEASE);
+		table->count--;
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	return value;
+}
+
+void *stream_table_next(struct stream_table *table, uint32_t *pos) {
+	struct stream_table_slots *slots = table->slots;
+	struct stream_table_entry *e;
+
+	while (*pos < slots->size) {
+		e = &slots->entries[(*pos)++];
+		if (e->value && e->value != STREAM_TABLE_REMOVED) {
+			return e->value;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef IBV_TABLE_H
+#define IBV_TABLE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// no of keys a table starts with room for
+#define STREAM_TABLE_INIT_SIZE 64
+
+/**
+ * An entry of the table, an empty slot has no value
+ */
+struct stream_table_entry {
+	uint32_t key;
+	void *value;
+};
+
+/**
+ * One generation of slots. The size is a power of two so a slot is found with
+ * a multiply and a shift.
+ */
+struct stream_table_slots {
+	uint32_t size;
+	// bits of the hash used for the slot
+	uint32_t shift;
+	// slots replaced by this generation, freed once no lookup is running
+	struct stream_table_slots *retired;
+	struct stream_table_entry entries[];
+};
+
+/**
+ * Open addressing hash table from a 32 bit key to a value, used to find a
+ * connection from its qp_num or id. Lookups take no lock and may run while
+ * keys are added or removed. Writers take the lock, a table that fills up is
+ * copied into a larger one. The old slots are kept while a lookup may still be
+ * walking them and freed by a later writer that sees no lookup running.
+ */
+struct stream_table {
+	// current slots, replaced as a whole when the table grows
+	struct stream_table_slots *slots;
+	// no of keys stored
+	uint32_t count;
+	// slots that are not empty, counting removed ones
+	uint32_t used;
+	// lookups running right now
+	uint32_t readers;
+	// serializes the writers
+	pthread_mutex_t lock;
+};
+
+/**
+ * Create a table with room for size keys to start with
+ */
+int stream_table_init(struct stream_table *table, uint32_t size);
+
+/**
+ * Free the table, no lookup may be running
+ */
+void stream_table_free(struct stream_table *table);
+
+/**
+ * Add a key, returns 1 if the key is already there or the table couldn't grow
+ */
+int stream_table_insert(struct stream_table *table, uint32_t key, void *value);
+
+/**
+ * Find the value of a key, NULL if it isn't there. A value found just before
+ * it is removed is returned, the owner of the value decides when it can go.
+ */
+void *stream_table_lookup(struct stream_table *table, uint32_t key);
+
+/**
+ * Remove a key, returns its value or NULL if it wasn't there
+ */
+void *stream_table_remove(struct stream_table *table, uint32_t key);
+
+/**
+ * Walk the values, start with pos at 0. Returns NULL after the last one. Not
+ * safe against writers.
+ */
+void *stream_table_next(struct stream_table *table, uint32_t *pos);
+
+#endif /* IBV_TABLE_H */
@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/lanes.h"
+#include "../src/stream_verbs.h"
+
+#define TEST_LANES 3
+// two words of the bitmap, so runs cross a word and the window wraps
+#define TEST_WINDOW 128
+#define TEST_MESSAGES 5000
+// the sequence the stream starts at, just short of the end of the window
+#define TEST_START 100
+
+/**
+ * Messages arrived on a lane and not delivered yet, in the order the lane
+ * received them
+ */
+struct test_lane {
+	uint64_t seqs[TEST_MESSAGES];
+	int head;
+	int tail;
+};
+
+static struct test_lane test_lanes[TEST_LANES];
+static uint64_t delivered = TEST_START;
+static int errors;
+
+// the lanes are only dispatched, the verbs they would use are stubbed out
+int stream_deliver_next(struct stream_connect_ctx *ctx) {
+	struct test_lane *lane = &test_lanes[ctx->lane];
+
+	if (lane->head == lane->tail || lane->seqs[lane->head] != delivered) {
+		fprintf(stderr, "Lane %d delivered out of order at %lu\n", ctx->lane,
+				(unsigned long) delivered);
+		errors++;
+		return 1;
+	}
+	lane->head++;
+	delivered++;
+	return 0;
+}
+
+int stream_dispatch(struct stream_connect_ctx *ctx) {
+	(void) ctx;
+	return 0;
+}
+
+struct stream_connect_ctx *stream_connect(struct stream_connect_cfg *cfg) {
+	(void) cfg;
+	return NULL;
+}
+
+int stream_close_ctx(struct stream_connect_ctx *ctx) {
+	(void) ctx;
+	return 0;
+}
+
+int stream_send_window(struct stream_connect_ctx *ctx) {
+	(void) ctx;
+	return 0;
+}
+
+int stream_send_part(struct stream_connect_ctx *ctx, const void *buf, uint64_t len,
+		uint16_t part) {
+	(void) ctx;
+	(void) buf;
+	(void) len;
+	(void) part;
+	return 1;
+}
+
+int stream_port_rate(const struct ibv_port_attr *attr) {
+	(void) attr;
+	return 0;
+}
+
+static int test_arrive(struct stream_lanes *lanes, uint64_t seq) {
+	int lane = seq % TEST_LANES;
+
+	test_lanes[lane].seqs[test_lanes[lane].tail++] = seq;
+	return stream_lanes_arrived(lanes, lane, seq);
+}
+
+int main() {
+	struct stream_connect_ctx ctxs[TEST_LANES] = { { 0 } };
+	struct stream_lanes *lanes;
+	uint64_t next[TEST_LANES], seq;
+	int i, lane, rounds, err = 0;
+
+	lanes = stream_lanes_create(1, TEST_LANES, 1, NULL, 0, TEST_WINDOW);
+	if (!lanes) {
+		return 1;
+	}
+	lanes->sequence = TEST_START;
+	for (i = 0; i < TEST_LANES; ++i) {
+		ctxs[i].lane = i;
+		ctxs[i].state = STREAM_CONNECTED;
+		if (stream_lanes_join(lanes, &ctxs[i])) {
+			return 1;
+		}
+	}
+
+	// a lane that falls behind holds up the others, across the end of the
+	// window
+	for (seq = TEST_START; seq < TEST_START + 60; ++seq) {
+		if (seq % TEST_LANES != TEST_START % TEST_LANES) {
+			test_arrive(lanes, seq);
+		}
+	}
+	stream_lanes_dispatch(lanes);
+	if (delivered != TEST_START) {
+		fprintf(stderr, "Delivered past the lane behind at %d\n", TEST_START);
+		err = 1;
+	}
+
+	if (!test_arrive(lanes, TEST_START + TEST_WINDOW)) {
+		fprintf(stderr, "Took a message outside the window\n");
+		err = 1;
+	}
+	test_lanes[(TEST_START + TEST_WINDOW) % TEST_LANES].tail--;
+
+	for (seq = TEST_START; seq < TEST_START + 60; seq += TEST_LANES) {
+		test_arrive(lanes, seq);
+	}
+	stream_lanes_dispatch(lanes);
+	if (delivered != TEST_START + 60) {
+		fprintf(stderr, "Delivered up to %lu, expected %d\n", (unsigned long) delivered,
+				TEST_START + 60);
+		err = 1;
+	}
+
+	// the whole window at once, a full word of it in one run
+	for (seq = TEST_START + 60; seq < TEST_START + 60 + TEST_WINDOW; ++seq) {
+		test_arrive(lanes, seq);
+	}
+	stream_lanes_dispatch(lanes);
+	if (delivered != TEST_START + 60 + TEST_WINDOW) {
+		fprintf(stderr, "Delivered up to %lu, expected %d\n", (unsigned long) delivered,
+				TEST_START + 60 + TEST_WINDOW);
+		err = 1;
+	}
+
+	// lane i carries the messages whose sequence is i modulo the lanes
+	for (i = 0; i < TEST_LANES; ++i) {
+		next[i] = TEST_START + 60 + TEST_WINDOW;
+		while (next[i] % TEST_LANES != (uint64_t) i) {
+			next[i]++;
+		}
+	}
+
+	// the lanes run at their own pace, each in order, with the window
+	// wrapping many times
+	srand48(1);
+	for (rounds = 0; delivered < TEST_START + TEST_MESSAGES && !errors &&
+			rounds < 100 * TEST_MESSAGES; ++rounds) {
+		for (i = 0; i < 8; ++i) {
+			lane = lrand48() % TEST_LANES;
+			if (next[lane] - delivered < TEST_WINDOW &&
+					next[lane] < TEST_START + TEST_MESSAGES) {
+				if (test_arrive(lanes, next[lane])) {
+					err = 1;
+				}
+				next[lane] += TEST_LANES;
+			}
+		}
+		stream_lanes_dispatch(lanes);
+	}
+
+	if (errors || delivered != TEST_START + TEST_MESSAGES ||
+			lanes->sequence != delivered) {
+		fprintf(stderr, "Delivered %lu of %d\n", (unsigned long) (delivered - TEST_START),
+				TEST_MESSAGES);
+		err = 1;
+	}
+
+	for (i = 0; i < TEST_LANES; ++i) {
+		stream_lanes_leave(lanes, &ctxs[i]);
+	}
+	stream_lanes_put(lanes);
+	printf("lanes: %s\n", err ? "FAIL" : "ok");
+	return err;
+}
@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/submit.h"
+
+#define TEST_PRODUCERS 4
+#define TEST_MESSAGES 100000
+#define TEST_DEPTH 64
+
+/**
+ * What a producer queues, its messages carry a count so the consumer can
+ * check none is lost, repeated or out of order
+ */
+struct test_msg {
+	uint32_t producer;
+	uint32_t count;
+};
+
+static struct stream_submit queue;
+
+static void *test_producer(void *arg) {
+	struct test_msg msg = {
+		.producer = (uint32_t) (uintptr_t) arg,
+	};
+	int ret;
+
+	for (msg.count = 0; msg.count < TEST_MESSAGES; ++msg.count) {
+		// a full queue waits for the consumer, which may share the core
+		while ((ret = stream_submit_push(&queue, &msg, sizeof msg)) == EAGAIN) {
+			sched_yield();
+		}
+		if (ret) {
+			fprintf(stderr, "Couldn't queue message %u of producer %u\n",
+					msg.count, msg.producer);
+			return (void *) 1;
+		}
+	}
+	return NULL;
+}
+
+int main() {
+	pthread_t producers[TEST_PRODUCERS];
+	struct stream_message msgs[TEST_DEPTH];
+	uint32_t next[TEST_PRODUCERS] = { 0 };
+	struct test_msg msg;
+	uint64_t taken = 0;
+	void *ret;
+	int i, n, err = 0;
+
+	if (stream_submit_init(&queue, TEST_DEPTH, sizeof msg)) {
+		return 1;
+	}
+
+	if (stream_submit_push(&queue, &msg, sizeof msg + 1) != 1) {
+		fprintf(stderr, "Queued a message larger than a slot\n");
+		err = 1;
+	}
+
+	for (i = 0; i < TEST_PRODUCERS; ++i) {
+		if (pthread_create(&producers[i], NULL, test_producer, (void *) (uintptr_t) i)) {
+			fprintf(stderr, "Couldn't start producer %d\n", i);
+			return 1;
+		}
+	}
+
+	// each producer's messages come out in the order it queued them
+	while (taken < (uint64_t) TEST_PRODUCERS * TEST_MESSAGES) {
+		n = stream_submit_peek(&queue, msgs, TEST_DEPTH);
+		if (n == 0) {
+			sched_yield();
+			continue;
+		}
+
+		for (i = 0; i < n; ++i) {
+			memcpy(&msg, msgs[i].buf, sizeof msg);
+			if (msgs[i].length != sizeof msg || msg.producer >= TEST_PRODUCERS ||
+					msg.count != next[msg.producer]) {
+				fprintf(stderr, "Unexpected message %u of producer %u\n",
+						msg.count, msg.producer);
+				err = 1;
+				break;
+			}
+			next[msg.producer]++;
+		}
+		// the producers may be stuck on a full queue, don't wait for them
+		if (err) {
+			printf("submit: FAIL\n");
+			return 1;
+		}
+		stream_submit_consume(&queue, n);
+		taken += n;
+	}
+
+	for (i = 0; i < TEST_PRODUCERS; ++i) {
+		pthread_join(producers[i], &ret);
+		if (ret) {
+			err = 1;
+		}
+	}
+
+	if (!err && stream_submit_peek(&queue, msgs, TEST_DEPTH) != 0) {
+		fprintf(stderr, "Messages left over\n");
+		err = 1;
+	}
+
+	stream_submit_free(&queue);
+	printf("submit: %s\n", err ? "FAIL" : "ok");
+	return err;
+}
@@ -0,0 +1,113 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../src/table.h"
+
+// keys go through several rounds of growing the table
+#define TEST_KEYS 10000
+#define TEST_ROUNDS 20
+
+static struct stream_table table;
+static int stop;
+static int bad_reads;
+
+/**
+ * A value of its own for every key, clear of the markers the table keeps in
+ * empty and removed slots
+ */
+static void *test_value(uint32_t key) {
+	return (void *) (uintptr_t) ((key + 1) * 16);
+}
+
+/**
+ * Look the keys up over and over while the main thread changes the table. A
+ * key may be there or not, but never with another key's value.
+ */
+static void *test_reader(void *arg) {
+	uint32_t key;
+	void *value;
+
+	(void) arg;
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		for (key = 0; key < TEST_KEYS; ++key) {
+			value = stream_table_lookup(&table, key);
+			if (value && value != test_value(key)) {
+				bad_reads++;
+			}
+		}
+	}
+	return NULL;
+}
+
+int main() {
+	pthread_t reader;
+	uint32_t key, pos = 0;
+	int round, count = 0, err = 0;
+
+	if (stream_table_init(&table, 4)) {
+		fprintf(stderr, "Couldn't create table\n");
+		return 1;
+	}
+
+	if (pthread_create(&reader, NULL, test_reader, NULL)) {
+		fprintf(stderr, "Couldn't start reader\n");
+		return 1;
+	}
+
+	for (round = 0; round < TEST_ROUNDS; ++round) {
+		for (key = 0; key < TEST_KEYS; ++key) {
+			if (stream_table_insert(&table, key, test_value(key))) {
+				fprintf(stderr, "Couldn't insert key %u\n", key);
+				err = 1;
+			}
+		}
+
+		if (!stream_table_insert(&table, 0, test_value(0))) {
+			fprintf(stderr, "Inserted key 0 twice\n");
+			err = 1;
+		}
+
+		// the odd ones leave removed slots behind for the next round
+		for (key = 1; key < TEST_KEYS; key += 2) {
+			if (stream_table_remove(&table, key) != test_value(key)) {
+				fprintf(stderr, "Couldn't remove key %u\n", key);
+				err = 1;
+			}
+		}
+
+		for (key = 0; key < TEST_KEYS; ++key) {
+			if (stream_table_lookup(&table, key) != (key % 2 ? NULL : test_value(key))) {
+				fprintf(stderr, "Wrong value for key %u in round %d\n", key, round);
+				err = 1;
+			}
+		}
+
+		for (key = 0; key < TEST_KEYS; key += 2) {
+			stream_table_remove(&table, key);
+		}
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(reader, NULL);
+
+	for (key = 0; key < TEST_KEYS; key += 3) {
+		stream_table_insert(&table, key, test_value(key));
+	}
+	while (stream_table_next(&table, &pos)) {
+		count++;
+	}
+	if (count != (TEST_KEYS + 2) / 3) {
+		fprintf(stderr, "Walked %d keys, expected %d\n", count, (TEST_KEYS + 2) / 3);
+		err = 1;
+	}
+
+	if (bad_reads) {
+		fprintf(stderr, "Reader saw %d wrong values\n", bad_reads);
+		err = 1;
+	}
+
+	stream_table_free(&table);
+	printf("table: %s\n", err ? "FAIL" : "ok");
+	return err;
+}